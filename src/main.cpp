@@ -46,12 +46,14 @@ int main(int argc, char* argv[]) {
   Search::init();
   Pawns::init();
   Threads.init();
+  Scouts.init();
   Tablebases::init(Options["SyzygyPath"]);
   TT.resize(Options["Hash"]);
   Parser::init();
 
   UCI::loop(argc, argv);
 
+  Scouts.exit();
   Threads.exit();
   return 0;
 }
@@ -44,9 +44,12 @@ typedef bool(*fun3_t)(HANDLE, CONST GROUP_AFFINITY*, PGROUP_AFFINITY);
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/mman.h>
-#include <sys/stat.h>
 #endif
 
+#include <sys/stat.h>
+
+#include <cstdio>
+#include <cstdlib>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
@@ -377,3 +380,54 @@ void mem_unmap(void* baseAddress, uint64_t mapping) {
 #endif
 }
 
+/// file_time() returns the last modification time of a file, 0 if not found
+
+uint64_t file_time(const char* fname) {
+
+  struct stat st;
+  return stat(fname, &st) ? 0 : uint64_t(st.st_mtime);
+}
+
+
+/// replace_file() renames a file over an existing one, replacing it atomically,
+/// so that there is no moment without the target. Returns false on failure.
+
+bool replace_file(const std::string& from, const std::string& to) {
+
+#ifndef _WIN32
+  return !std::rename(from.c_str(), to.c_str());
+#else
+  return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING);
+#endif
+}
+
+
+/// full_path() returns the canonical absolute path of an existing file, so that
+/// different names of the same file compare equal, otherwise the name as is.
+
+std::string full_path(const std::string& fname) {
+
+#ifndef _WIN32
+  char* path = realpath(fname.c_str(), nullptr);
+  std::string s = path ? path : fname;
+  free(path);
+  return s;
+#else
+  char path[_MAX_PATH];
+  return _fullpath(path, fname.c_str(), _MAX_PATH) ? path : fname;
+#endif
+}
+
+
+/// mem_advise() hints the OS that a mapped file will be needed soon, so that it
+/// is read ahead. No-op on Windows.
+
+void mem_advise(void* baseAddress, uint64_t size) {
+
+#ifndef _WIN32
+    madvise(baseAddress, size, MADV_WILLNEED);
+#else
+    (void)baseAddress, (void)size;
+#endif
+}
+
@@ -29,6 +29,14 @@
 
 #include "types.h"
 
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#  include <intrin.h> // Microsoft header for __rdtsc()
+#  define USE_RDTSC
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  include <x86intrin.h>
+#  define USE_RDTSC
+#endif
+
 const std::string engine_info(bool to_uci = false);
 void prefetch(void* addr);
 void start_logger(const std::string& fname);
@@ -45,6 +53,18 @@ inline TimePoint now() {
         (std::chrono::steady_clock::now().time_since_epoch()).count();
 }
 
+/// cycles() returns the processor time stamp counter, or nanoseconds where it
+/// is not available. Useful to profile very short code paths.
+
+inline uint64_t cycles() {
+#ifdef USE_RDTSC
+  return __rdtsc();
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>
+        (std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
 template<class Entry, int Size>
 struct HashTable {
   Entry* operator[](Key key) { return &table[(uint32_t)key & (Size - 1)]; }
@@ -110,6 +130,10 @@ namespace WinProcGroup {
 
 void mem_map(const char* fname, void** baseAddress, uint64_t* mapping, uint64_t* size);
 void mem_unmap(void* baseAddress, uint64_t mapping);
+void mem_advise(void* baseAddress, uint64_t size);
+uint64_t file_time(const char* fname);
+std::string full_path(const std::string& fname);
+bool replace_file(const std::string& from, const std::string& to);
 
 
 /// Convert a number of type T into a sequence of bytes in big-endian format
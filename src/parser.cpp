@@ -19,6 +19,7 @@
 */
 
 #include <algorithm>
+#include <cctype>
 #include <cstdint>
 #include <cstdio>
 #include <fstream>
@@ -65,6 +66,7 @@ enum Step : uint8_t {
 Token ToToken[256];
 Step ToStep[STATE_NB][TOKEN_NB];
 Position RootPos;
+TimePoint ProgressInterval, StartTime, LastProgress;
 
 void error(Step* state, const char* data) {
 
@@ -170,6 +172,28 @@ GameResult get_result(const char* data) {
     return GameResult::Unknown;
 }
 
+/// report_progress() prints an info line with the progress of the parsing, if
+/// enough time has passed since the last report. Called every few games.
+
+void report_progress(uint64_t bytes, uint64_t size, int64_t games, int64_t moves) {
+
+    TimePoint elapsed = now() - StartTime + 1;
+
+    if (!ProgressInterval || elapsed - LastProgress < ProgressInterval)
+        return;
+
+    LastProgress = elapsed;
+
+    sync_cout << "info time " << elapsed
+              << " games " << games
+              << " moves " << moves
+              << " bytes " << bytes
+              << " bytes/second " << 1000 * bytes / elapsed
+              << " progress " << 100 * bytes / std::max(size, uint64_t(1)) << "%"
+              << " eta " << (bytes ? elapsed * (size - bytes) / bytes : 0)
+              << sync_endl;
+}
+
 void parse_pgn(void* baseAddress, uint64_t size, PGNStats& stats, std::ofstream& db, uint64_t startOfs) {
 
     Step* stateStack[16];
@@ -307,6 +331,9 @@ void parse_pgn(void* baseAddress, uint64_t size, PGNStats& stats, std::ofstream&
             gameCnt++;
             result = GameResult::Unknown;
             ofs = (data - (char*)baseAddress) + 1; // Beginning of next game
+
+            if (!(gameCnt & 1023))
+                report_progress(ofs, size, gameCnt, moveCnt);
             end = curMove = moves;
             fenEnd = fen;
             state = ToStep[HEADER];
@@ -353,6 +380,83 @@ void parse_pgn(void* baseAddress, uint64_t size, PGNStats& stats, std::ofstream&
     stats.fixed = fixed;
 }
 
+/// write_opening() writes the ply-major opening block of the DB stored in
+/// [data, end): the first plies of all the games stored one ply at a time, i.e.
+/// first ply of every game, then second ply and so on. The modification time of
+/// the DB is stored too. Returns the number of games in the DB.
+size_t write_opening(Move* data, Move* end, std::ofstream& db, uint64_t plyCount, uint64_t dbTime) {
+
+    uint8_t header[4 * sizeof(uint64_t)], ofs[sizeof(uint64_t)];
+    std::vector<Move*> games;
+
+    // Collect the beginning of each game
+    for (Move* cur = data; cur < end; cur = Scout::next_game(cur))
+        games.push_back(cur);
+
+    // Header stores game count, ply count, DB size and modification time to
+    // detect stale blocks, followed by the index of each game in the DB and the
+    // results.
+    write_be(plyCount, write_be(uint64_t(games.size()), header));
+    write_be(dbTime, write_be(uint64_t(end - data), header + 2 * sizeof(uint64_t)));
+    db.write((const char*)header, sizeof(header));
+
+    for (Move* g : games)
+    {
+        write_be(uint64_t(g - data), ofs);
+        db.write((const char*)ofs, sizeof(ofs));
+    }
+
+    std::vector<Move> buf(games.size());
+
+    for (size_t i = 0; i < games.size(); ++i)
+        buf[i] = *(games[i] + 4);
+
+    db.write((const char*)buf.data(), buf.size() * sizeof(Move));
+
+    // Then the plies, once a game is finished it is padded with MOVE_NONE
+    for (Move*& g : games)
+        g += 5;
+
+    for (uint64_t ply = 0; ply < plyCount; ++ply)
+    {
+        for (size_t i = 0; i < games.size(); ++i)
+        {
+            buf[i] = *games[i];
+            if (buf[i] != MOVE_NONE)
+                games[i]++;
+        }
+        db.write((const char*)buf.data(), buf.size() * sizeof(Move));
+    }
+
+    return games.size();
+}
+
+/// tag_value() returns the value of the given tag in the header of the PGN
+/// game starting at 'data', or an empty string if the tag is missing.
+std::string tag_value(const char* data, const char* end, const std::string& key) {
+
+    std::string tag = "[" + key + " \"";
+
+    while (data < end && ::isspace(*data))
+        ++data;
+
+    while (data < end && *data == '[')
+    {
+        const char* eol = std::find(data, end, '\n');
+
+        if (   size_t(eol - data) > tag.size()
+            && !strncmp(data, tag.c_str(), tag.size()))
+        {
+            const char* value = data + tag.size();
+            return std::string(value, std::find(value, eol, '"'));
+        }
+
+        for (data = eol; data < end && ::isspace(*data); ++data) {}
+    }
+
+    return std::string();
+}
+
 } // namespace
 
 const char* play_game(const Position& pos, Move move, const char* cur, const char* end) {
@@ -558,12 +662,20 @@ void make_db(std::istringstream& is) {
     if (lastdot != std::string::npos)
         dbName = dbName.substr(0, lastdot);
     dbName += ".scout";
+
+    // An open DB is closed while rewritten, then opened again. Its cached
+    // results are dropped.
+    bool reopen = Scout::close_db(dbName);
+    Scout::clear_results(dbName);
+
     std::ofstream db;
     db.open(dbName, std::ofstream::out | std::ofstream::binary);
 
     std::cerr << "\nProcessing...";
 
-    TimePoint elapsed = now();
+    TimePoint elapsed = StartTime = now();
+    ProgressInterval = Options["Progress Interval"];
+    LastProgress = 0;
 
     parse_pgn(baseAddress, size, stats, db, stoll(startOfs));
 
@@ -576,6 +688,9 @@ void make_db(std::istringstream& is) {
 
     std::cerr << "done" << std::endl;
 
+    if (reopen)
+        Scout::open_db(dbName);
+
     // Output info in JSON format
     std::string tab = "\n    ";
     std::stringstream json;
@@ -594,4 +709,205 @@ void make_db(std::istringstream& is) {
     std::cout << json.str() << std::endl;
 }
 
+/// make_opening() writes the ply-major opening block of a DB, so that queries
+/// limited to the opening phase can stream a small contiguous region instead
+/// of striding over entire games.
+
+void make_opening(std::istringstream& is) {
+
+    uint64_t mapping, size;
+    void* baseAddress;
+    std::string dbName, plies;
+
+    is >> dbName;
+
+    if (dbName.empty())
+    {
+        std::cerr << "Missing DB file name..." << std::endl;
+        exit(0);
+    }
+
+    is >> plies;
+
+    if (plies.empty())
+        plies = "32";
+
+    uint64_t plyCount = stoll(plies);
+    bool reopen = Scout::close_db(dbName);
+    Scout::clear_results(dbName);
+
+    mem_map(dbName.c_str(), &baseAddress, &mapping, &size);
+
+    std::string blockName = Scout::opening_name(dbName);
+    std::ofstream db;
+    db.open(blockName, std::ofstream::out | std::ofstream::binary);
+
+    TimePoint elapsed = now();
+
+    Move* data = (Move*)baseAddress;
+    size_t games = write_opening(data, data + size / sizeof(Move), db, plyCount, file_time(dbName.c_str()));
+
+    elapsed = now() - elapsed + 1;
+
+    mem_unmap(baseAddress, mapping);
+
+    size_t blockSize = db.tellp();
+    db.close();
+
+    if (reopen)
+        Scout::open_db(dbName);
+
+    // Output info in JSON format
+    std::string tab = "\n    ";
+    std::stringstream json;
+    json << "{"
+         << tab << "\"Games\": " << games << ","
+         << tab << "\"Plies\": " << plyCount << ","
+         << tab << "\"Opening file\": \"" << blockName << "\","
+         << tab << "\"Opening file size\": " << blockSize << ","
+         << tab << "\"Processing time (ms)\": " << elapsed << "\n"
+         << "}";
+
+    std::cout << json.str() << std::endl;
+}
+
+/// optimize_db() rewrites a DB with the games clustered for locality: sorted by
+/// their opening moves or, if a tag name is given, by the value of that tag in
+/// the PGN headers. Games with the same key keep their original order. The
+/// opening block, if any, is rebuilt too.
+
+void optimize_db(std::istringstream& is) {
+
+    uint64_t mapping, size, plyCount = 0;
+    void* baseAddress;
+    std::string dbName, key;
+
+    is >> dbName;
+
+    if (dbName.empty())
+    {
+        std::cerr << "Missing DB file name..." << std::endl;
+        exit(0);
+    }
+
+    is >> key;
+
+    bool reopen = Scout::close_db(dbName);
+    Scout::clear_results(dbName);
+
+    mem_map(dbName.c_str(), &baseAddress, &mapping, &size);
+
+    TimePoint elapsed = now();
+
+    struct Game {
+        Move* data;
+        size_t len;
+        std::string tag;
+    };
+
+    Move* data = (Move*)baseAddress;
+    Move* end = data + size / sizeof(Move);
+    std::vector<Game> games;
+
+    // Collect the games
+    for (Move* cur = data; cur < end; )
+    {
+        Move* next = Scout::next_game(cur);
+        games.push_back({cur, size_t(next - cur), std::string()});
+        cur = next;
+    }
+
+    if (!key.empty())
+    {
+        uint64_t pgnMapping, pgnSize, gameOfs;
+        void* pgnAddress;
+        std::string pgnName = dbName.substr(0, dbName.find_last_of(".")) + ".pgn";
+
+        if (!std::ifstream(pgnName))
+        {
+            std::cerr << "Missing PGN file " << pgnName << std::endl;
+            exit(0);
+        }
+
+        mem_map(pgnName.c_str(), &pgnAddress, &pgnMapping, &pgnSize);
+
+        const char* pgn = (const char*)pgnAddress;
+
+        for (Game& g : games)
+        {
+            read_be(gameOfs, (uint8_t*)g.data);
+            if (gameOfs < pgnSize)
+                g.tag = tag_value(pgn + gameOfs, pgn + pgnSize, key);
+        }
+
+        mem_unmap(pgnAddress, pgnMapping);
+
+        std::stable_sort(games.begin(), games.end(), [](const Game& a, const Game& b) {
+                             return a.tag < b.tag; });
+    }
+    else
+        std::stable_sort(games.begin(), games.end(), [](const Game& a, const Game& b) {
+                             return std::lexicographical_compare(a.data + 5, a.data + a.len,
+                                                                 b.data + 5, b.data + b.len); });
+
+    std::string tmpName = dbName + ".tmp";
+    std::ofstream db;
+    db.open(tmpName, std::ofstream::out | std::ofstream::binary);
+
+    for (const Game& g : games)
+        db.write((const char*)g.data, g.len * sizeof(Move));
+
+    db.close();
+    mem_unmap(baseAddress, mapping);
+
+    // The optimized DB replaces the original one in a single step, so on
+    // failure the original DB is kept, and opened again if it was.
+    if (!db || !replace_file(tmpName, dbName))
+    {
+        std::cerr << "Could not " << (db ? "rename " : "write ") << tmpName
+                  << ", " << dbName << " left unchanged" << std::endl;
+        std::remove(tmpName.c_str());
+
+        if (reopen)
+            Scout::open_db(dbName);
+        return;
+    }
+
+    // Rebuild the opening block, if any, with the same number of plies
+    std::string blockName = Scout::opening_name(dbName);
+    std::ifstream block(blockName, std::ifstream::binary);
+    if (block)
+    {
+        uint8_t header[2 * sizeof(uint64_t)];
+        block.read((char*)header, sizeof(header));
+        read_be(plyCount, header + sizeof(uint64_t));
+        block.close();
+
+        mem_map(dbName.c_str(), &baseAddress, &mapping, &size);
+        db.open(blockName, std::ofstream::out | std::ofstream::binary);
+        data = (Move*)baseAddress;
+        write_opening(data, data + size / sizeof(Move), db, plyCount, file_time(dbName.c_str()));
+        db.close();
+        mem_unmap(baseAddress, mapping);
+    }
+
+    if (reopen)
+        Scout::open_db(dbName);
+
+    elapsed = now() - elapsed + 1;
+
+    // Output info in JSON format
+    std::string tab = "\n    ";
+    std::stringstream json;
+    json << "{"
+         << tab << "\"Games\": " << games.size() << ","
+         << tab << "\"Sort key\": \"" << (key.empty() ? "opening" : key) << "\","
+         << tab << "\"DB file\": \"" << dbName << "\","
+         << tab << "\"Opening plies\": " << plyCount << ","
+         << tab << "\"Processing time (ms)\": " << elapsed << "\n"
+         << "}";
+
+    std::cout << json.str() << std::endl;
+}
+
 }
@@ -57,6 +57,10 @@ struct StateInfo {
   Bitboard   checkSquares[PIECE_TYPE_NB];
 };
 
+namespace Zobrist {
+  extern Key psq[PIECE_NB][SQUARE_NB];
+}
+
 // In a std::deque references to elements are unaffected upon resizing
 typedef std::unique_ptr<std::deque<StateInfo>> StateListPtr;
 
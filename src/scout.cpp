@@ -20,17 +20,24 @@
 
 #include <algorithm>
 #include <cctype>    // tolower(), isdigit()
+#include <cfloat>
+#include <cmath>
 #include <cstdint>
 #include <cstdio>
+#include <cstring>
 #include <exception>
 #include <fstream>
 #include <iostream>
+#include <list>
 #include <map>
+#include <memory>
 #include <sstream>
 #include <string>
+#include <sys/stat.h>
 
 #include "json.hpp"
 #include "misc.h"
+#include "movegen.h"
 #include "position.h"
 #include "search.h"
 #include "thread.h"
@@ -42,6 +49,36 @@ namespace Scout {
 
 const std::string PieceToChar(" PNBRQK  pnbrqk");
 
+const char* RuleNames[] = {
+  "none", "pass", "result", "result-type", "sub-fen", "material", "imbalance",
+  "move", "quiet", "captured", "moved", "white", "black", "expression",
+  "matched condition", "matched query"
+};
+
+const char* ResultNames[] = { "", "1-0", "0-1", "1/2-1/2", "*", "?" };
+
+const char* PlanNames[] = { "full scan", "opening block" };
+
+// Number of games replayed by each thread to sample rules statistics
+const size_t SampleGames = 2048;
+
+// Sub-fen lists bigger than this are indexed with a decision tree
+const size_t SubFenIndexSize = 256;
+
+// Size of the chunks stolen by the threads, in moves of the DB and in games of
+// the opening block. Do not depend on the number of threads.
+const size_t GameChunkSize = 1 << 16;
+const size_t PlyChunkSize = 1024;
+
+// Reading a move without replaying it costs this fraction of a rule check
+const uint64_t SkipCostDiv = 16;
+
+// Seed of the random order of the chunks sampled by the approximate queries
+const uint64_t SampleSeed = 1070372;
+
+// Opening block header: games, plies, DB size and DB modification time
+const size_t OpeningHeaderSize = 4 * sizeof(uint64_t) / sizeof(Move);
+
 
 /// Helper function to verify if the move's 'from' square satisfies
 /// the disambiguation rule, if any.
@@ -60,6 +97,8 @@ bool from_sq_ok(int d, Square from) {
 /// alias.
 Move* detect_next_game(Move* data) {
 
+  Move* start = data;
+
   // Forward scan to find the first game separator candidate
   while (*data != MOVE_NONE)
       data++;
@@ -72,310 +111,2728 @@ Move* detect_next_game(Move* data) {
       data++;
 
   // FIXME handle the case of game shorter than 4 moves
-  return data + 1;
+  data++;
+
+  // If we started inside the offset of a game, we have found the beginning of
+  // that same game, that belongs to the previous chunk: skip it.
+  if (data < start)
+      data = next_game(data);
+
+  return data;
 }
 
 
-/// search() re-play all the games and after each move look if the current
-/// position matches the requested rules.
+/// Board is a stripped-down Position used to re-play the games of the DB. Moves
+/// are known to be legal, so only what the rules look at is updated: bitboards,
+/// piece counts, material key, non-pawn material and side to move. There is no
+/// state stack, castling rights and en-passant square are tracked just to setup
+/// a full Position at the end of the game, when looking for mate or stalemate.
+
+struct Board {
+
+  void set(const Position& pos);
+  void do_move(Move m);
+  const std::string fen() const;
+  ResultType result_type() const;
+
+  Bitboard pieces(Color c) const { return byColorBB[c]; }
+  Bitboard pieces(PieceType pt) const { return byTypeBB[pt]; }
+  Piece piece_on(Square s) const { return board[s]; }
+  Piece moved_piece(Move m) const { return board[from_sq(m)]; }
+  Color side_to_move() const { return sideToMove; }
+  Key material_key() const { return materialKey; }
+  Value non_pawn_material(Color c) const { return nonPawnMaterial[c]; }
+  template<PieceType Pt> int count(Color c) const { return pieceCount[make_piece(c, Pt)]; }
+  uint64_t material_counts() const;
+
+  bool capture(Move m) const {
+    // Castling is encoded as "king captures rook"
+    return (board[to_sq(m)] != NO_PIECE && type_of(m) != CASTLING) || type_of(m) == ENPASSANT;
+  }
 
-void search(Thread* th) {
+private:
+  void put_piece(Piece pc, Square s);
+  void remove_piece(Square s);
+  void move_piece(Square from, Square to);
 
-  static_assert(sizeof(uint64_t) == 4 * sizeof(Move), "Wrong Move size");
+  Piece board[SQUARE_NB];
+  Bitboard byTypeBB[PIECE_TYPE_NB];
+  Bitboard byColorBB[COLOR_NB];
+  int pieceCount[PIECE_NB];
+  Key materialKey;
+  Value nonPawnMaterial[COLOR_NB];
+  Color sideToMove;
+  int castlingRights;
+  Square epSquare;
+};
 
-  StateInfo states[1024], *st = states;
-  uint64_t gameOfs;
-  const Condition* cond;
-  const RuleType *rules, *curRule;
-  const SubFen *subfens, *subfensEnd;
-  std::vector<size_t> matchPlies;
-  size_t condIdx = 0, streakStartPly = 0;
-  Scout::Data& d = th->scout;
-  size_t maxMatches = d.limit ? d.skip + d.limit : 0;
-  d.matches.reserve(maxMatches ? maxMatches : 100000);
-  matchPlies.reserve(128);
-
-  // Lambda helper to copy hot stuff to local variables
-  auto set_condition = [&] (size_t idx) {
-    cond = d.conditions.data() + idx;
-    rules = cond->rules.data();
-    subfens = cond->subfens.data();
-    subfensEnd = subfens + cond->subfens.size();
-
-    // Clear plies when resetting the first condition
-    if (!idx)
-        matchPlies.clear();
-
-    // When starting a new streak ignore previous plies
-    else if (   cond->streakId
-             && cond->streakId != (cond-1)->streakId)
-        streakStartPly = matchPlies.size();
-  };
-  set_condition(condIdx);
+/// Board::material_counts() packs the number of pieces of each type but the
+/// kings, 4 bits each, in a unique material signature.
+
+inline uint64_t Board::material_counts() const {
+
+  uint64_t counts = 0;
+
+  for (Color c = WHITE; c <= BLACK; ++c)
+      for (PieceType pt = PAWN; pt <= QUEEN; ++pt)
+          counts |= uint64_t(pieceCount[make_piece(c, pt)]) << (4 * (5 * c + pt - PAWN));
+
+  return counts;
+}
+
+inline void Board::put_piece(Piece pc, Square s) {
+
+  board[s] = pc;
+  byTypeBB[ALL_PIECES] |= s;
+  byTypeBB[type_of(pc)] |= s;
+  byColorBB[color_of(pc)] |= s;
+  materialKey ^= Zobrist::psq[pc][pieceCount[pc]++];
+
+  if (type_of(pc) != PAWN)
+      nonPawnMaterial[color_of(pc)] += PieceValue[MG][pc]; // King is zero
+}
+
+inline void Board::remove_piece(Square s) {
+
+  Piece pc = board[s];
+  board[s] = NO_PIECE;
+  byTypeBB[ALL_PIECES] ^= s;
+  byTypeBB[type_of(pc)] ^= s;
+  byColorBB[color_of(pc)] ^= s;
+  materialKey ^= Zobrist::psq[pc][--pieceCount[pc]];
+
+  if (type_of(pc) != PAWN)
+      nonPawnMaterial[color_of(pc)] -= PieceValue[MG][pc];
+}
 
-  // Compute our file sub-range to search
-  size_t range = d.dbSize  / Threads.size();
-  Move* data = d.baseAddress + th->idx * range;
-  Move* end = th->idx == Threads.size() - 1 ? d.baseAddress + d.dbSize : data + range;
+inline void Board::move_piece(Square from, Square to) {
 
-  // Move to the beginning of the next game
-  if (data != d.baseAddress)
+  Piece pc = board[from];
+  Bitboard from_to_bb = SquareBB[from] ^ SquareBB[to];
+  byTypeBB[ALL_PIECES] ^= from_to_bb;
+  byTypeBB[type_of(pc)] ^= from_to_bb;
+  byColorBB[color_of(pc)] ^= from_to_bb;
+  board[from] = NO_PIECE;
+  board[to] = pc;
+}
+
+void Board::set(const Position& pos) {
+
+  std::memset(this, 0, sizeof(Board));
+
+  for (Square s = SQ_A1; s <= SQ_H8; ++s)
+      if (pos.piece_on(s) != NO_PIECE)
+          put_piece(pos.piece_on(s), s);
+
+  sideToMove = pos.side_to_move();
+  castlingRights = pos.can_castle(ANY_CASTLING);
+  epSquare = pos.ep_square();
+}
+
+inline void Board::do_move(Move m) {
+
+  Color us = sideToMove;
+  Square from = from_sq(m);
+  Square to = to_sq(m);
+  Piece pc = board[from];
+
+  // Games in the DB start from the standard position, so castling rights are
+  // lost when king or rooks leave (or rooks are captured on) their squares.
+  if (castlingRights)
+      for (Square s : { from, to })
+          castlingRights &= ~(  s == SQ_E1 ? WHITE_OO | WHITE_OOO
+                              : s == SQ_H1 ? WHITE_OO
+                              : s == SQ_A1 ? WHITE_OOO
+                              : s == SQ_E8 ? BLACK_OO | BLACK_OOO
+                              : s == SQ_H8 ? BLACK_OO
+                              : s == SQ_A8 ? BLACK_OOO : 0);
+
+  if (type_of(m) == CASTLING)
+  {
+      bool kingSide = to > from; // Castling is encoded as "king captures rook"
+      remove_piece(from);
+      remove_piece(to);
+      put_piece(pc, relative_square(us, kingSide ? SQ_G1 : SQ_C1));
+      put_piece(make_piece(us, ROOK), relative_square(us, kingSide ? SQ_F1 : SQ_D1));
+  }
+  else
+  {
+      if (type_of(m) == ENPASSANT)
+          remove_piece(to - pawn_push(us));
+
+      else if (board[to] != NO_PIECE)
+          remove_piece(to);
+
+      move_piece(from, to);
+
+      if (type_of(m) == PROMOTION)
+      {
+          remove_piece(to);
+          put_piece(make_piece(us, promotion_type(m)), to);
+      }
+  }
+
+  epSquare =   type_of(pc) == PAWN && (int(to) ^ int(from)) == 16
+             ? Square((int(from) + int(to)) / 2) : SQ_NONE;
+  sideToMove = ~us;
+}
+
+const std::string Board::fen() const {
+
+  int emptyCnt;
+  std::ostringstream ss;
+
+  for (Rank r = RANK_8; r >= RANK_1; --r)
   {
-      assert(data > d.baseAddress + 4);
+      for (File f = FILE_A; f <= FILE_H; ++f)
+      {
+          for (emptyCnt = 0; f <= FILE_H && board[make_square(f, r)] == NO_PIECE; ++f)
+              ++emptyCnt;
+
+          if (emptyCnt)
+              ss << emptyCnt;
 
-      data = detect_next_game(data);
+          if (f <= FILE_H)
+              ss << PieceToChar[board[make_square(f, r)]];
+      }
+
+      if (r > RANK_1)
+          ss << '/';
   }
 
-  // Should point to game offset, just after the end of previous game
-  assert(data == d.baseAddress || *(data-1) == MOVE_NONE);
+  ss << (sideToMove == WHITE ? " w " : " b ");
+
+  if (castlingRights & WHITE_OO)
+      ss << 'K';
+
+  if (castlingRights & WHITE_OOO)
+      ss << 'Q';
+
+  if (castlingRights & BLACK_OO)
+      ss << 'k';
+
+  if (castlingRights & BLACK_OOO)
+      ss << 'q';
+
+  if (!castlingRights)
+      ss << '-';
+
+  ss << (epSquare == SQ_NONE ? " - " : " " + UCI::square(epSquare) + " ") << "0 1";
 
-  // Main loop, replay all games until we finish our file chunk
-  while (data < end)
+  return ss.str();
+}
+
+/// Board::result_type() sets up a full Position to check whether the side to
+/// move has been mated or stalemated. It is slow, but called only at the end
+/// of the games.
+
+ResultType Board::result_type() const {
+
+  StateInfo st;
+  Position pos;
+  pos.set(fen(), false, &st, nullptr);
+
+  return  MoveList<LEGAL>(pos).size() ? ResultNone
+        : pos.checkers()              ? ResultMate : ResultStalemate;
+}
+
+
+/// Budget tracks the matches still needed by a query with a limit. Chunks are
+/// settled in DB order: once the settled ones hold skip + limit matches, the
+/// later chunks can not change the result and are not searched anymore. An
+/// approximate query needs only the chunks whose rank is below its sample size.
+/// A query stopped, or out of time, does not need the chunks not opened yet.
+
+struct Budget {
+  size_t needed;                 // skip + limit, 0 if there is no limit
+  size_t sampled;                // Chunks in the sample, all if not approximate
+  std::atomic<size_t> settled;   // Number of settled chunks
+  std::atomic<size_t> matches;   // Matches of the settled chunks
+  std::vector<size_t> counts;    // Matches of each completed chunk
+  std::atomic<size_t> stopChunk; // First chunk not needed anymore
+  std::atomic<size_t> cutChunk;  // First chunk not searched due to a stop
+};
+
+
+/// atomic_min() lowers an atomic value to v, if bigger, also when other threads
+/// lower it at the same time.
+
+void atomic_min(std::atomic<size_t>& a, size_t v) {
+
+  size_t cur = a.load(std::memory_order_relaxed);
+
+  while (v < cur && !a.compare_exchange_weak(cur, v)) {}
+}
+
+/// StreamNode holds the matches of a query found in a chunk, to be printed while
+/// searching with "stream". Threads push the nodes, when closing a chunk, in a
+/// lock-free stack that the output thread pops all at once, so that there are
+/// no ABA issues.
+
+struct StreamNode {
+  size_t query, chunk;
+  std::vector<MatchingGame> matches;
+  StreamNode* next;
+};
+
+/// SharedState is the state of a scout search shared among the threads: the
+/// next chunk to search, the match budget of each query and the progress.
+
+struct SharedState {
+  std::atomic<size_t> nextChunk, doneChunks;
+  size_t begin, chunks; // First move, or game of the opening block, and chunks
+  TimePoint startTime, progressInterval, lastProgress; // Milliseconds
+  Board root; // Position the games start from
+  std::vector<size_t> ranks; // Random rank of each chunk, when sampling
+  Mutex mutex;
+  std::unique_ptr<Budget[]> budgets;
+  std::atomic<StreamNode*> streamHead; // Matches to stream, not printed yet
+  std::atomic_bool streamDone;         // Set when the threads are done
+  std::thread streamer;                // Prints the matches to stream
+};
+
+SharedState Shared;
+
+
+/// check() tests a single rule against the current position. Rules that do not
+/// depend on the position, like the ones ending a condition, are not handled.
+
+template<RuleType R>
+bool check(const Condition* cond, const Board& pos, Move move, GameResult result);
+
+template<>
+inline bool check<RulePass>(const Condition*, const Board&, Move, GameResult) {
+  return true;
+}
+
+template<>
+inline bool check<RuleResult>(const Condition* cond, const Board&, Move, GameResult result) {
+  return std::find(cond->results.begin(), cond->results.end(), result) != cond->results.end();
+}
+
+template<>
+inline bool check<RuleResultType>(const Condition* cond, const Board& pos, Move move, GameResult) {
+  return !move && pos.result_type() == cond->resultType; // End of game
+}
+
+/// match_subfens() returns true if any pattern of the set matches the position
+/// with the given bitboards, indexed like the masks of SubFen.
+
+inline bool match_subfens(const SubFenSet& set, const Bitboard b[]) {
+
+  const Bitboard* masks = set.masks.data();
+
+  // A pattern matches when no masked piece is missing, i.e. when all its masks
+  // are subsets of the corresponding bitboards. Most patterns already fail on
+  // the color masks, so they are tested first.
+#if defined(USE_AVX2) || defined(USE_AVX512)
+
+  // Patterns are checked in chunks of 64: the color masks of the whole chunk
+  // are tested at once without branches, then the piece type masks are tested
+  // only for the few candidates that survive.
+#if defined(USE_AVX512)
+  const __m512i nw = _mm512_set1_epi64(int64_t(~b[WHITE]));
+  const __m512i nb = _mm512_set1_epi64(int64_t(~b[BLACK]));
+#else
+  const __m256i w = _mm256_set1_epi64x(int64_t(b[WHITE]));
+  const __m256i bl = _mm256_set1_epi64x(int64_t(b[BLACK]));
+  const __m256i zero = _mm256_setzero_si256();
+#endif
+
+  for (size_t i = 0; i < set.size; i += 64)
   {
-      // First 4 moves store the game offset, skip them
-      Move* gameOfsPtr = data;
-      data += 4;
+      const Bitboard* mw = masks + i;
+      const Bitboard* mb = masks + set.stride + i;
+      size_t n = std::min(set.size - i, size_t(64));
+      uint64_t candidates = 0;
+
+#if defined(USE_AVX512)
+      // A pattern is a candidate if no square of its masks is missing from
+      // the board, i.e. the masks have no square in common with the negated
+      // color bitboards.
+      for (size_t j = 0; j < n; j += 8)
+          candidates |= uint64_t(  _mm512_testn_epi64_mask(_mm512_loadu_si512(mw + j), nw)
+                                 & _mm512_testn_epi64_mask(_mm512_loadu_si512(mb + j), nb)) << j;
+#else
+      for (size_t j = 0; j < n; j += 4)
+      {
+          __m256i missing = _mm256_or_si256(
+              _mm256_andnot_si256(w, _mm256_loadu_si256((const __m256i*)(mw + j))),
+              _mm256_andnot_si256(bl, _mm256_loadu_si256((const __m256i*)(mb + j))));
+          candidates |= uint64_t(_mm256_movemask_pd(_mm256_castsi256_pd(
+                                 _mm256_cmpeq_epi64(missing, zero)))) << j;
+      }
+#endif
 
-      // Fifth move stores the result in the 'to' square
-      GameResult result = GameResult(to_sq(Move(*data)));
+      // Padding patterns have empty masks, do not let them match
+      if (n < 64)
+          candidates &= (1ULL << n) - 1;
 
-      // If needed, reset conditions before starting a new game
-      if (condIdx != 0)
+      while (candidates)
       {
-          condIdx = 0;
-          set_condition(condIdx);
+          size_t idx = i + pop_lsb(&candidates);
+          bool found = true;
+
+          for (int k : set.used)
+              if (masks[k * set.stride + idx] & ~b[k])
+              {
+                  found = false;
+                  break;
+              }
+
+          if (found)
+              return true;
       }
+  }
 
-      st = states;
-      Position pos = th->rootPos;
-      data++; // First move of the game
+#else
 
-      // Loop across the game (that could be empty)
-      do {
-          Move move = *data; // Could be MOVE_NONE
+  for (size_t i = 0; i < set.size; ++i)
+  {
+      if ((masks[i] & ~b[WHITE]) | (masks[set.stride + i] & ~b[BLACK]))
+          continue;
 
-          assert(!move || (pos.pseudo_legal(move) && pos.legal(move)));
+      bool found = true;
 
-          // If we are looking for a streak, fail and reset as soon as last
-          // matched ply is more than one half-move behind. We take care to
-          // verify the last matched ply comes form the same streak.
-          if (   cond->streakId
-              && matchPlies.size() - streakStartPly > 0
-              && matchPlies.back() != pos.nodes_searched() - 1)
+      for (int k : set.used)
+          if (masks[k * set.stride + i] & ~b[k])
           {
-              assert(condIdx);
-
-              condIdx = 0;
-              set_condition(condIdx);
+              found = false;
+              break;
           }
 
-          curRule = rules;
+      if (found)
+          return true;
+  }
+
+#endif
+
+  return false;
+}
+
+
+/// match_index() walks the decision tree of a big sub-fen list. At each inner
+/// node only the patterns requiring the piece actually on the node square, if
+/// any, and the ones not caring about that square can still match.
+
+bool match_index(const SubFenIndex& index, int n, const Board& pos, const Bitboard b[]) {
+
+  const SubFenNode& node = index.nodes[n];
+
+  if (node.sq == SQ_NONE)
+      return match_subfens(node.leaf, b);
+
+  Piece pc = pos.piece_on(node.sq);
+
+  return   (pc != NO_PIECE && node.children[pc] && match_index(index, node.children[pc], pos, b))
+        || (node.children[NO_PIECE] && match_index(index, node.children[NO_PIECE], pos, b));
+}
+
+template<>
+inline bool check<RuleSubFen>(const Condition* cond, const Board& pos, Move, GameResult) {
+
+  Bitboard b[SubFenMaskNb];
+
+  b[WHITE] = pos.pieces(WHITE);
+  b[BLACK] = pos.pieces(BLACK);
+  for (PieceType pt = PAWN; pt <= KING; ++pt)
+      b[1 + pt] = pos.pieces(pt);
+
+  return cond->subfenIndex.nodes.empty() ? match_subfens(cond->subfens, b)
+                                         : match_index(cond->subfenIndex, 0, pos, b);
+}
+
+template<>
+inline bool check<RuleMaterial>(const Condition* cond, const Board& pos, Move, GameResult) {
+  return cond->matKeys.contains(pos.material_key());
+}
+
+template<>
+inline bool check<RuleImbalance>(const Condition* cond, const Board& pos, Move, GameResult) {
+
+  for (const Imbalance& imb : cond->imbalances)
+      if (   imb.nonPawnMaterial ==  pos.non_pawn_material(WHITE)
+                                   - pos.non_pawn_material(BLACK)
+          && imb.pawnCount ==  pos.count<PAWN>(WHITE)
+                             - pos.count<PAWN>(BLACK))
+          return true;
+  return false;
+}
+
+template<>
+inline bool check<RuleMove>(const Condition* cond, const Board& pos, Move move, GameResult) {
+
+  if (cond->moveSquares & to_sq(move))
+      for (const ScoutMove& m : cond->moves)
+      {
+          if (   pos.moved_piece(move) != m.pc
+              || to_sq(move) != m.to
+              || m.castle != (type_of(move) == CASTLING)
+              || !from_sq_ok(m.disambiguation, from_sq(move)))
+              continue;
+          return true;
+      }
+  return false;
+}
+
+template<>
+inline bool check<RuleQuietMove>(const Condition*, const Board& pos, Move move, GameResult) {
+  return move && !pos.capture(move);
+}
+
+template<>
+inline bool check<RuleCapturedPiece>(const Condition* cond, const Board& pos, Move move, GameResult) {
+
+  if (move && pos.capture(move))
+  {
+      PieceType pt = type_of(move) == NORMAL ? type_of(pos.piece_on(to_sq(move))) : PAWN;
+      return cond->capturedFlags & (1 << int(pt));
+  }
+  return false;
+}
+
+template<>
+inline bool check<RuleMovedPiece>(const Condition* cond, const Board& pos, Move move, GameResult) {
+  return move && (cond->movedFlags & (1 << int(type_of(pos.moved_piece(move)))));
+}
+
+template<>
+inline bool check<RuleWhite>(const Condition*, const Board& pos, Move, GameResult) {
+  return pos.side_to_move() == WHITE;
+}
+
+template<>
+inline bool check<RuleBlack>(const Condition*, const Board& pos, Move, GameResult) {
+  return pos.side_to_move() == BLACK;
+}
+
+
+/// eval_expr() evaluates a node of an expression, with short-circuit of "and"
+/// and "or" nodes. The result of a sub-condition is cached, so it is computed
+/// once even if shared by many leaves.
+
+bool eval_expr(const Expr& e, size_t idx, const Board& pos, Move move, GameResult result) {
+
+  const ExprNode& n = e.nodes[idx];
+
+  switch (n.type) {
+  case ExprLeaf:
+      if (e.values[n.leaf] < 0)
+      {
+          const Condition& c = e.leaves[n.leaf];
+          e.values[n.leaf] = c.matcher(&c, pos, move, result) == RuleMatchedCondition;
+      }
+      return e.values[n.leaf];
+
+  case ExprAnd:
+      for (size_t c : n.children)
+          if (!eval_expr(e, c, pos, move, result))
+              return false;
+      return true;
+
+  case ExprOr:
+      for (size_t c : n.children)
+          if (eval_expr(e, c, pos, move, result))
+              return true;
+      return false;
+
+  default:
+      return !eval_expr(e, n.children[0], pos, move, result);
+  }
+}
+
+// A failing result rule of a sub-condition does not skip the game, because it
+// could be negated or in alternative to other sub-conditions.
+template<>
+inline bool check<RuleExpr>(const Condition* cond, const Board& pos, Move move, GameResult result) {
+
+  std::fill(cond->expr.values.begin(), cond->expr.values.end(), -1);
+  return eval_expr(cond->expr, 0, pos, move, result);
+}
+
+
+/// match() is the generic matcher: it interprets the rules of a condition one
+/// by one, with an early exit as soon as one fails. It returns the rule ending
+/// the list, RuleMatchedCondition or RuleMatchedQuery, if all the rules are
+/// satisfied, RuleResult if the game can be skipped because its result will
+/// not change, and RuleNone otherwise.
+
+RuleType match(const Condition* cond, const Board& pos, Move move, GameResult result) {
+
+  const RuleType* curRule = cond->rules.data();
 
 NextRule: // Loop across rules, early exit as soon as one fails
-          switch (*curRule++) {
+  switch (*curRule++) {
+
+  case RuleNone:
+      break;
+
+  case RuleResult:
+      if (check<RuleResult>(cond, pos, move, result))
+          goto NextRule;
+      return RuleResult; // Shortcut: result will not change
+
+#define CHECK(R) case R: if (check<R>(cond, pos, move, result)) goto NextRule; break
+  CHECK(RulePass);
+  CHECK(RuleResultType);
+  CHECK(RuleSubFen);
+  CHECK(RuleMaterial);
+  CHECK(RuleImbalance);
+  CHECK(RuleMove);
+  CHECK(RuleQuietMove);
+  CHECK(RuleCapturedPiece);
+  CHECK(RuleMovedPiece);
+  CHECK(RuleWhite);
+  CHECK(RuleBlack);
+  CHECK(RuleExpr);
+#undef CHECK
+
+  case RuleMatchedCondition:
+  case RuleMatchedQuery:
+      return *(curRule - 1);
+  }
 
-          case RuleNone:
-              break;
+  return RuleNone;
+}
 
-          case RulePass:
-              goto NextRule;
 
-          case RuleResult:
-              if (std::find(cond->results.begin(), cond->results.end(),
-                            result) != cond->results.end())
-                  goto NextRule;
-              goto SkipToNextGame; // Shortcut: result will not change
+/// RuleList is the specialized matcher of a condition whose rules are known at
+/// compile time: the rule checks are inlined one after the other, there is no
+/// dispatch and no work is spent on rules that are not in the list. Return
+/// value is the same of match().
 
-          case RuleResultType:
-              if (   !move // End of game
-                  && !MoveList<LEGAL>(pos).size()
-                  && !!pos.checkers() == (cond->resultType == ResultMate))
-                  goto NextRule;
-              break;
+template<RuleType... Rules> struct RuleList;
 
-          case RuleSubFen:
-              for (const SubFen* f = subfens; f < subfensEnd; ++f)
-              {
-                  if (   (pos.pieces(WHITE) & f->white) != f->white
-                      || (pos.pieces(BLACK) & f->black) != f->black)
-                      continue;
+template<> struct RuleList<> {
+  static RuleType match(const Condition* cond, const Board&, Move, GameResult) {
+    return cond->rules.back();
+  }
+};
+
+template<RuleType R, RuleType... Rules> struct RuleList<R, Rules...> {
+  static RuleType match(const Condition* cond, const Board& pos, Move move, GameResult result) {
+    return  check<R>(cond, pos, move, result) ? RuleList<Rules...>::match(cond, pos, move, result)
+          : R == RuleResult ? RuleResult : RuleNone;
+  }
+};
+
+
+/// select_matcher() returns the specialized matcher for the given rule list,
+/// terminating rule excluded, falling back on the generic one in case of an
+/// uncommon combination. Pairs are instantiated in both orders, because rules
+/// could be reordered according to their selectivity.
+
+template<RuleType R1, RuleType R2>
+void add_pair(std::map<std::vector<RuleType>, Matcher>& m) {
+
+  m[{ R1, R2 }] = RuleList<R1, R2>::match;
+  m[{ R2, R1 }] = RuleList<R2, R1>::match;
+}
+
+Matcher select_matcher(const std::vector<RuleType>& rules) {
+
+  static const std::map<std::vector<RuleType>, Matcher> Matchers = [] {
+
+    std::map<std::vector<RuleType>, Matcher> m;
+
+    m[{ RulePass          }] = RuleList<RulePass>::match;
+    m[{ RuleSubFen        }] = RuleList<RuleSubFen>::match;
+    m[{ RuleMaterial      }] = RuleList<RuleMaterial>::match;
+    m[{ RuleImbalance     }] = RuleList<RuleImbalance>::match;
+    m[{ RuleMove          }] = RuleList<RuleMove>::match;
+    m[{ RuleQuietMove     }] = RuleList<RuleQuietMove>::match;
+    m[{ RuleCapturedPiece }] = RuleList<RuleCapturedPiece>::match;
+    m[{ RuleMovedPiece    }] = RuleList<RuleMovedPiece>::match;
+
+    add_pair<RuleSubFen, RuleWhite>(m);
+    add_pair<RuleSubFen, RuleBlack>(m);
+    add_pair<RuleSubFen, RuleMaterial>(m);
+    add_pair<RuleMaterial, RuleWhite>(m);
+    add_pair<RuleMaterial, RuleBlack>(m);
+    add_pair<RuleResult, RuleSubFen>(m);
+    add_pair<RuleResult, RuleMaterial>(m);
+    add_pair<RuleResult, RuleImbalance>(m);
+    add_pair<RuleResult, RuleMove>(m);
+    add_pair<RuleResult, RuleResultType>(m);
+    add_pair<RuleCapturedPiece, RuleWhite>(m);
+    add_pair<RuleCapturedPiece, RuleBlack>(m);
+    add_pair<RuleCapturedPiece, RuleMovedPiece>(m);
+
+    m[{ RuleResult, RuleCapturedPiece, RuleMovedPiece }] =
+        RuleList<RuleResult, RuleCapturedPiece, RuleMovedPiece>::match;
+
+    return m;
+  }();
+
+  if (rules.empty())
+      return match;
+
+  auto it = Matchers.find(std::vector<RuleType>(rules.begin(), rules.end() - 1));
+  return it != Matchers.end() ? it->second : match;
+}
+
+
+/// check() with the rule given at runtime, used when we need to evaluate each
+/// rule on its own, i.e. when sampling rules statistics.
+
+bool check(RuleType r, const Condition* cond, const Board& pos, Move move, GameResult result) {
+
+  switch (r) {
+  case RulePass:          return check<RulePass         >(cond, pos, move, result);
+  case RuleResult:        return check<RuleResult       >(cond, pos, move, result);
+  case RuleResultType:    return check<RuleResultType   >(cond, pos, move, result);
+  case RuleSubFen:        return check<RuleSubFen       >(cond, pos, move, result);
+  case RuleMaterial:      return check<RuleMaterial     >(cond, pos, move, result);
+  case RuleImbalance:     return check<RuleImbalance    >(cond, pos, move, result);
+  case RuleMove:          return check<RuleMove         >(cond, pos, move, result);
+  case RuleQuietMove:     return check<RuleQuietMove    >(cond, pos, move, result);
+  case RuleCapturedPiece: return check<RuleCapturedPiece>(cond, pos, move, result);
+  case RuleMovedPiece:    return check<RuleMovedPiece   >(cond, pos, move, result);
+  case RuleWhite:         return check<RuleWhite        >(cond, pos, move, result);
+  case RuleBlack:         return check<RuleBlack        >(cond, pos, move, result);
+  case RuleExpr:          return check<RuleExpr         >(cond, pos, move, result);
+  default:                return false;
+  }
+}
+
+
+/// sample() is used as the matcher of all the conditions on the first games of
+/// each thread. It evaluates all the rules, with no early exit, to collect for
+/// each one the number of calls, the number of passes and the elapsed cycles.
+/// The rules up to the first failing one are counted also in the profile, as
+/// profile() would do. Return value is the same of match().
+
+RuleType sample(const Condition* cond, const Board& pos, Move move, GameResult result) {
+
+  bool pass = true, skip = false;
+
+  for (size_t i = 0; i + 1 < cond->rules.size(); ++i)
+  {
+      uint64_t start = cycles();
+      bool ok = check(cond->rules[i], cond, pos, move, result);
+      uint64_t elapsed = cycles() - start;
+      RuleStats& s = cond->stats[i];
+
+      s.cycles += elapsed;
+      s.calls++;
+      s.passes += ok;
+
+      if (pass)
+      {
+          RuleStats& p = cond->profileStats[i];
+
+          p.cycles += elapsed;
+          p.calls++;
+          p.passes += ok;
+      }
+
+      pass = pass && ok;
+      skip = skip || (!ok && cond->rules[i] == RuleResult);
+  }
+
+  return pass ? cond->rules.back() : skip ? RuleResult : RuleNone;
+}
+
+
+/// profile() is used, after the sampling, as the matcher of the conditions of
+/// the queries with "profile". Like match() it exits as soon as a rule fails,
+/// but for each evaluated rule it keeps counting calls, passes and cycles.
+
+RuleType profile(const Condition* cond, const Board& pos, Move move, GameResult result) {
+
+  for (size_t i = 0; i + 1 < cond->rules.size(); ++i)
+  {
+      uint64_t start = cycles();
+      bool ok = check(cond->rules[i], cond, pos, move, result);
+      RuleStats& s = cond->profileStats[i];
+
+      s.cycles += cycles() - start;
+      s.calls++;
+      s.passes += ok;
+
+      if (!ok)
+          return cond->rules[i] == RuleResult ? RuleResult : RuleNone;
+  }
+
+  return cond->rules.back();
+}
+
+
+/// start_sampling() sets sample() as the matcher of all the conditions
+
+void start_sampling(Scout::Data& d) {
+
+  for (Query& q : d.queries)
+      for (Condition& cond : q.conditions)
+          cond.matcher = sample;
+}
+
+
+/// reorder_rules() sorts the rules of each condition according to the sampled
+/// statistics, so that cheap and selective rules come first and the matcher
+/// exits as early as possible. Assuming independent rules, the best order is by
+/// ascending cost divided by failure rate. Result rule always stays in front
+/// because when it fails the whole game is skipped. Then the matchers are
+/// selected again, ending the sampling, or set to profile() if requested.
+
+void reorder_rules(Scout::Data& d) {
+
+  const uint64_t MinCalls = 256;
+
+  for (Query& q : d.queries)
+      for (Condition& cond : q.conditions)
+      {
+          size_t cnt = cond.rules.size() - 1; // Terminating rule does not move
+
+          if (cnt < 2 || cond.stats[0].calls < MinCalls)
+          {
+              cond.matcher = q.profile ? profile : select_matcher(cond.rules);
+              continue;
+          }
+
+          std::vector<double> rank(cnt);
+          std::vector<size_t> idx(cnt);
+
+          for (size_t i = 0; i < cnt; ++i)
+          {
+              const RuleStats& s = cond.stats[i];
+              double failRate = double(s.calls - s.passes) / s.calls;
+              rank[i] =  cond.rules[i] == RuleResult ? -1
+                       : failRate > 0 ? double(s.cycles) / s.calls / failRate : DBL_MAX;
+              idx[i] = i;
+          }
+
+          std::stable_sort(idx.begin(), idx.end(), [&](size_t a, size_t b) {
+                               return rank[a] < rank[b]; });
+
+          std::vector<RuleType> rules(cond.rules);
+          std::vector<RuleStats> stats(cond.stats), profileStats(cond.profileStats);
+
+          for (size_t i = 0; i < cnt; ++i)
+          {
+              cond.rules[i] = rules[idx[i]];
+              cond.stats[i] = stats[idx[i]];
+              cond.profileStats[i] = profileStats[idx[i]];
+          }
+
+          cond.matcher = q.profile ? profile : select_matcher(cond.rules);
+      }
+}
+
+
+/// group_key() returns the key of the group of a match, for the queries that
+/// aggregate the matches with "group-by".
+
+uint64_t group_key(const Query& q, const Board& pos, Move move, GameResult result, size_t ply) {
+
+  switch (q.groupBy) {
+  case GroupResult:     return result;
+  case GroupMaterial:   return pos.material_counts();
+  case GroupSideToMove: return pos.side_to_move();
+  case GroupPly:        return ply / q.plyBucket;
+  case GroupNextMove:   return move;
+  default:              return 0;
+  }
+}
+
+
+/// Cursor keeps track of how far a game has gone along the chain of conditions
+/// of a query, together with the plies matched so far. When many queries are
+/// run in a batch, each one has its own cursor. The chain is run as a small NFA
+/// with a state for each condition, where a partial match waits for it, and all
+/// the live states are advanced at each ply. So overlapping partial matches are
+/// not missed, e.g. when a streak fails another one can already be half-way.
+///
+/// There is at most one partial match for each state: if the condition has no
+/// window the earliest one dominates, because it can match in any later ply,
+/// otherwise the latest one, whose window stays open longer. A partial match
+/// waiting for a condition without window, that can not be skipped, dominates
+/// also the ones waiting for the previous conditions, so a plain sequence has
+/// just one live state.
+
+struct Cursor {
+
+  struct Partial {
+    int last;   // Ply of the last matched condition, -1 at game start
+    size_t len; // Number of matched plies, stored in the row of the state
+    bool live;
+  };
+
+  void kill(size_t k) {
+
+    liveCnt -= states[k].live;
+    states[k].live = false;
+  }
+
+  bool enter(size_t k, size_t from, int ply, const Board* pos, Move move, GameResult result);
+  bool finish(size_t from, int ply, const Board* pos, Move move, GameResult result);
+  bool advance(size_t k, RuleType r, const Board& pos, Move move, GameResult result, size_t ply);
+
+  // Reset the cursor at the beginning of the game at the given index in the DB.
+  // The cursor stays inactive if the query does not need more matches out of
+  // the current chunk, or if it resumes a previous search after this game.
+  bool new_game(uint64_t gameIdx) {
+
+    for (size_t k = 0; k < size; ++k)
+        states[k].live = false;
+
+    states[0] = { -1, 0, true };
+    liveCnt = 1;
+    top = 0;
+
+    matched = startMatch = false;
+    active =   query->sampled
+            && !query->full
+            && query->chunk < budget->stopChunk.load(std::memory_order_relaxed)
+            && gameIdx >= query->resume;
+
+    // With all the conditions optional the query matches at game start, the
+    // group key is set on the first ply.
+    if (active && conds[0].optional)
+        enter(1, 0, -1, nullptr, MOVE_NONE, Unknown);
+
+    return active;
+  }
+
+  // Check the current position against the conditions of the live states, in
+  // reverse order so that a partial match is advanced at most once per ply.
+  // Return false when done with the game: the query has matched, it can not
+  // match anymore or the last ply has been reached. With "all-plies" the query
+  // keeps being checked after the match, until the end of the game.
+  bool step(const Board& pos, Move move, GameResult result, size_t ply) {
+
+    if (startMatch)
+    {
+        startMatch = false;
+
+        if (query->groupBy)
+            groupKey = group_key(*query, pos, move, result, ply);
+
+        if (!query->allPlies)
+            return active = false;
+    }
+
+    size_t k = top, left = liveCnt;
+
+    do {
+        if (!states[k].live)
+            continue;
+
+        --left;
+        Condition& cond = conds[k];
+
+        // Window of the condition is closed
+        if (cond.window && int(ply) - states[k].last > cond.window)
+        {
+            kill(k);
+            continue;
+        }
+
+        RuleType r = cond.matcher(&cond, pos, move, result);
+
+        if (r != RuleNone && !advance(k, r, pos, move, result, ply))
+            return active = false;
+
+    } while (left && k-- > 0);
+
+    return active = liveCnt && ply < lastPly;
+  }
+
+  Query* query;
+  Budget* budget;
+  Condition* conds;
+  size_t size, liveCnt, top, lastPly; // Top is the highest live state, if any
+  std::vector<Partial> states;
+  std::vector<uint16_t> plies; // A row of matched plies for each state
+  std::vector<uint16_t> matchPlies;
+  uint64_t groupKey;
+  bool active, matched, startMatch;
+};
+
+
+/// Cursor::enter() enters in state k the partial match of state 'from', extended
+/// with the ply if not negative. Then, if condition k is optional, enters also
+/// in the next state skipping it. Skipping the last condition completes the
+/// match, so returns false when done with the game as advance() does.
+
+bool Cursor::enter(size_t k, size_t from, int ply, const Board* pos, Move move, GameResult result) {
+
+  while (true)
+  {
+      if (k == size)
+          return finish(from, ply, pos, move, result);
+
+      const Condition& cond = conds[k];
+      Partial& s = states[k];
+
+      // An earlier partial match waiting for a condition without window
+      // dominates, but if the condition is optional the path skipping it is
+      // still entered, because it carries a more recent ply.
+      if (!s.live || cond.window)
+      {
+          const Partial& f = states[from];
+          uint16_t* row = &plies[k * size];
+
+          std::copy(&plies[from * size], &plies[from * size] + f.len, row);
+          size_t len = f.len;
+
+          if (ply >= 0)
+              row[len++] = uint16_t(ply);
+
+          liveCnt += !s.live;
+          s = { ply >= 0 ? ply : f.last, len, true };
+          top = std::max(top, k);
+
+          // The partial matches waiting for the previous conditions have to
+          // pass through this one, unless it can be skipped.
+          if (!cond.window && !cond.optional)
+              for (size_t j = 0; j < k; ++j)
+                  kill(j);
+      }
+
+      if (!cond.optional)
+          return true;
+
+      // Skipping condition k extends the partial match of 'from' as entering
+      // state k does, so 'from' and ply are kept.
+      ++k;
+  }
+}
+
+
+/// Cursor::advance() is called when the condition of state k has matched or has
+/// failed for the whole game. Returns false when done with the game.
+
+bool Cursor::advance(size_t k, RuleType r, const Board& pos, Move move, GameResult result, size_t ply) {
+
+  if (r == RuleResult) // Shortcut: result will not change
+  {
+      if (!conds[k].optional)
+          return false;
+
+      kill(k);
+      return true;
+  }
+
+  return enter(k + 1, k, int(ply), &pos, move, result);
+}
+
+
+/// Cursor::finish() completes the match with the partial match of state 'from',
+/// extended with the ply if not negative. At game start there is no position
+/// yet, so the group key is left to the first step(). Returns false when done
+/// with the game.
+
+bool Cursor::finish(size_t from, int ply, const Board* pos, Move move, GameResult result) {
+
+  // Query matched, on following matches just add the ply
+  if (!matched)
+  {
+      matchPlies.assign(&plies[from * size], &plies[from * size] + states[from].len);
+
+      if (query->groupBy && pos)
+          groupKey = group_key(*query, *pos, move, result, size_t(ply));
+
+      startMatch = !pos;
+  }
+
+  if (ply >= 0)
+      matchPlies.push_back(uint16_t(ply));
+
+  matched = true;
+
+  return query->allPlies;
+}
+
+
+/// init_cursors() sets up a cursor for each query of the batch
+
+void init_cursors(Scout::Data& d, std::vector<Cursor>& cursors) {
+
+  cursors.resize(d.queries.size());
+
+  for (size_t i = 0; i < d.queries.size(); ++i)
+  {
+      Query& q = d.queries[i];
+      Cursor& c = cursors[i];
+
+      c.query = &q;
+      c.budget = &Shared.budgets[i];
+      c.conds = q.conditions.data();
+      c.size = q.conditions.size();
+      c.lastPly = q.maxPly >= 0 ? size_t(q.maxPly) : SIZE_MAX;
+      c.states.resize(c.size);
+      c.plies.resize(c.size * c.size);
+      c.matchPlies.reserve(128);
+  }
+}
+
+
+/// chunk_needed() returns true if some query still needs matches out of the
+/// chunk being searched. Budgets only shrink, so if it returns false, neither
+/// the next chunks are needed.
+
+bool chunk_needed(const Scout::Data& d) {
+
+  for (size_t i = 0; i < d.queries.size(); ++i)
+      if (   !d.queries[i].full
+          &&  d.queries[i].chunk < Shared.budgets[i].stopChunk)
+          return true;
+
+  return false;
+}
+
+
+/// next_chunk() returns the next chunk to search. If a query is stopped, or runs
+/// out of time, it is cut at the first chunk fetched afterwards. Chunks are
+/// fetched in DB order under lock, so all the chunks before the cut one are
+/// searched in full, and none of the ones after it, see print_query(). The first
+/// chunk is not cut out of time, so that resuming always makes progress.
+
+size_t next_chunk(const Scout::Data& d) {
+
+  std::unique_lock<Mutex> lk(Shared.mutex);
+
+  size_t chunk = Shared.nextChunk++;
+  TimePoint elapsed = now() - Shared.startTime;
+  bool stop = Scouts.stop;
+
+  if (chunk < Shared.chunks)
+      for (size_t i = 0; i < d.queries.size(); ++i)
+      {
+          const Query& q = d.queries[i];
+          Budget& b = Shared.budgets[i];
+
+          if (   (stop || (q.maxTime && elapsed >= q.maxTime && chunk))
+              && chunk < b.stopChunk)
+          {
+              atomic_min(b.cutChunk, chunk);
+              atomic_min(b.stopChunk, chunk);
+          }
+      }
+
+  return chunk;
+}
+
+
+/// open_chunk() prepares the queries for the search of a new chunk. Returns
+/// false if no query needs it.
+
+bool open_chunk(Scout::Data& d, size_t chunk) {
+
+  for (size_t i = 0; i < d.queries.size(); ++i)
+  {
+      Query& q = d.queries[i];
+
+      q.chunk = chunk;
+      q.chunkBegin = q.output == OutputCount ? q.count : q.matches.size();
+      q.full = false;
+      q.sampled =  Shared.ranks.empty()
+                || Shared.ranks[chunk] < Shared.budgets[i].sampled;
+  }
+
+  return chunk_needed(d);
+}
+
+
+/// chunk_sampled() returns true if the chunk being searched is in the sample of
+/// some query. Queries that are not approximate sample all the chunks.
+
+bool chunk_sampled(const Scout::Data& d) {
+
+  for (const Query& q : d.queries)
+      if (q.sampled)
+          return true;
+
+  return false;
+}
+
+
+/// add_match() stores a new match, or just counts it for the aggregate queries.
+/// If all the chunks before the current one are settled and, together with the
+/// matches of the current chunk, they fill the budget of the query, the rest of
+/// the DB is not needed anymore.
+
+void add_match(Cursor& c, uint64_t gameIdx, uint64_t gameOfs) {
+
+  Query& q = *c.query;
+  Budget& b = *c.budget;
+
+  // Aggregates just count the matches, out of any budget
+  if (q.output == OutputCount)
+  {
+      q.count++;
+
+      if (q.groupBy)
+          q.groups[c.groupKey]++;
+
+      return;
+  }
+
+  q.matches.push_back({gameIdx, gameOfs, c.matchPlies});
+
+  if (!b.needed)
+      return;
+
+  // Budget is read without locking: close_chunk() updates the matches before
+  // the settled chunks, so once the chunks before ours are seen settled their
+  // matches are all counted.
+  if (   b.settled.load(std::memory_order_acquire) == q.chunk
+      && b.matches.load(std::memory_order_relaxed) + q.matches.size() - q.chunkBegin >= b.needed)
+  {
+      q.full = true;
+      atomic_min(b.stopChunk, q.chunk + 1);
+  }
+}
+
+
+/// close_chunk() records, for each query, where the matches found in the given
+/// chunk end, so that at the end they can be sorted in DB order, and passes
+/// them to the output thread if streaming. Then settles the chunks completed
+/// so far, in DB order, and updates the budgets and the counters of the games
+/// and moves replayed so far, read by report_progress().
+
+void close_chunk(Scout::Data& d, size_t games, size_t moves) {
+
+  // Matches to stream are pushed also if none, to tell the chunk is complete
+  if (d.stream)
+      for (size_t i = 0; i < d.queries.size(); ++i)
+          if (d.queries[i].output == OutputMatches)
+          {
+              const Query& q = d.queries[i];
+              StreamNode* n = new StreamNode{i, q.chunk, std::vector<MatchingGame>(
+                                             q.matches.begin() + q.chunkBegin, q.matches.end()), nullptr};
+
+              n->next = Shared.streamHead.load(std::memory_order_relaxed);
+              while (!Shared.streamHead.compare_exchange_weak(n->next, n, std::memory_order_release,
+                                                                          std::memory_order_relaxed)) {}
+          }
+
+  std::unique_lock<Mutex> lk(Shared.mutex);
+
+  Shared.doneChunks++;
+  d.gamesCnt = games;
+  d.movesCnt = moves;
+
+  for (size_t i = 0; i < d.queries.size(); ++i)
+  {
+      Query& q = d.queries[i];
+      Budget& b = Shared.budgets[i];
+      size_t found = (q.output == OutputCount ? q.count : q.matches.size()) - q.chunkBegin;
+
+      q.chunks.push_back(std::make_pair(q.chunk, q.matches.size()));
+      d.matchesCnt += found;
+
+      if (q.sample > 0 && q.sampled)
+          q.samples.push_back(std::make_pair(q.chunk, found));
+
+      if (!b.needed)
+          continue;
+
+      b.counts[q.chunk] = q.matches.size() - q.chunkBegin;
+
+      for (size_t s = b.settled; s < Shared.chunks && b.counts[s] != SIZE_MAX; )
+      {
+          b.matches += b.counts[s];
+          b.settled = ++s;
+
+          if (b.matches >= b.needed)
+          {
+              atomic_min(b.stopChunk, s);
+              break;
+          }
+      }
+  }
+}
+
+
+/// report_progress() is called by the main thread at the beginning of each of
+/// its chunks and, if enough time has passed since the last report, prints an
+/// info line with the progress of the search, summing the counters of all the
+/// threads, that are updated at the end of each chunk under lock.
+
+void report_progress() {
+
+  TimePoint elapsed = now() - Shared.startTime + 1;
+
+  if (   !Shared.progressInterval
+      || elapsed - Shared.lastProgress < Shared.progressInterval)
+      return;
+
+  size_t games = 0, moves = 0, matches = 0, done;
+
+  {
+      std::unique_lock<Mutex> lk(Shared.mutex);
+
+      done = Shared.doneChunks;
+
+      for (ScoutThread* th : Scouts)
+      {
+          games += th->scout.gamesCnt;
+          moves += th->scout.movesCnt;
+          matches += th->scout.matchesCnt;
+      }
+  }
+
+  uint64_t bytes = (moves + 6 * games) * sizeof(Move); // 4+1+1 for ofs, result and MOVE_NONE
+
+  Shared.lastProgress = elapsed;
+
+  sync_cout << "info time " << elapsed
+            << " games " << games
+            << " bytes " << bytes
+            << " matches " << matches
+            << " bytes/second " << 1000 * bytes / elapsed
+            << " progress " << 100 * done / std::max(Shared.chunks, size_t(1)) << "%"
+            << " eta " << (done ? elapsed * (Shared.chunks - done) / done : 0)
+            << sync_endl;
+}
+
+
+/// search_games() re-play all the games and after each move look if the current
+/// position matches the requested rules. Each game is replayed once for all the
+/// queries of the batch. The DB is split in chunks of GameChunkSize moves that
+/// are stolen by the threads as soon as they are idle, so that threads whose
+/// chunks are slower to search do not delay the others.
+
+void search_games(ScoutThread* th) {
+
+  static_assert(sizeof(uint64_t) == 4 * sizeof(Move), "Wrong Move size");
+
+  uint64_t gameOfs;
+  const Board& root = Shared.root;
+  Scout::Data& d = th->scout;
+  std::vector<Cursor> cursors;
+  size_t games = 0, movesCnt = 0, chunk;
+  bool done = false;
+
+  init_cursors(d, cursors);
+
+  while (!done && (chunk = next_chunk(d)) < Shared.chunks)
+  {
+      // Terminate if all the queries have collected enough data
+      if (!open_chunk(d, chunk))
+          break;
+
+      if (th == Scouts.main())
+          report_progress();
+
+      // Skip the chunks that only approximate queries could need
+      if (!chunk_sampled(d))
+      {
+          close_chunk(d, games, movesCnt);
+          continue;
+      }
+
+      // Compute our chunk file sub-range to search, the first one starts at the
+      // beginning of a game.
+      Move* data = d.baseAddress + Shared.begin + chunk * GameChunkSize;
+      Move* end = std::min(data + GameChunkSize, d.baseAddress + d.dbSize);
+
+      // Move to the beginning of the next game
+      if (chunk)
+      {
+          assert(data > d.baseAddress + 4);
+
+          data = detect_next_game(data);
+      }
+
+      // Should point to game offset, just after the end of previous game
+      assert(data == d.baseAddress || *(data-1) == MOVE_NONE);
+
+      // Main loop, replay all games until we finish our file chunk
+      for ( ; data < end; ++games)
+      {
+          size_t active = 0;
+
+          if (games == SampleGames)
+              reorder_rules(d);
+
+          for (Cursor& c : cursors)
+              active += c.new_game(data - d.baseAddress);
+
+          // Terminate if all the queries have collected enough data
+          if (!active && !chunk_needed(d))
+          {
+              done = true;
+              break;
+          }
+
+          // First 4 moves store the game offset, skip them
+          Move* gameOfsPtr = data;
+          data += 4;
+
+          // Fifth move stores the result in the 'to' square
+          GameResult result = GameResult(to_sq(Move(*data)));
+
+          Board pos = root;
+          size_t ply = 0;
+          data++; // First move of the game
+
+          // Loop across the game (that could be empty)
+          do {
+              Move move = *data; // Could be MOVE_NONE
+
+              for (Cursor& c : cursors)
+                  if (c.active && !c.step(pos, move, result, ply))
+                  {
+                      --active;
+
+                      if (c.matched)
+                      {
+                          read_be(gameOfs, (uint8_t*)gameOfsPtr);
+                          add_match(c, gameOfsPtr - d.baseAddress, gameOfs);
+                      }
+                  }
+
+              // Skip to the end of the game when all the queries are done with it
+              if (!active && *data != MOVE_NONE)
+              {
+                  d.skippedCnt++;
+
+                  while (*data != MOVE_NONE)
+                      ++data;
+              }
+
+              // Do the move after rule checking
+              if (move)
+                  pos.do_move(move);
+
+              ++ply;
+
+          } while (*data++ != MOVE_NONE); // Exit the game loop pointing to next ofs
+
+          // With "all-plies" a query that matched is still active at game end
+          for (Cursor& c : cursors)
+              if (c.active && c.matched)
+              {
+                  read_be(gameOfs, (uint8_t*)gameOfsPtr);
+                  add_match(c, gameOfsPtr - d.baseAddress, gameOfs);
+              }
+
+          // Can't use ply due to skipping moves after a match
+          movesCnt += data - gameOfsPtr - 6; // 4+1+1 for ofs, result and MOVE_NONE
+          d.pliesCnt += ply;
+      }
+
+      close_chunk(d, games, movesCnt);
+  }
+}
+
+
+/// search_plies() is used instead of search_games() when the queries are limited
+/// to the first plies and the DB has a ply-major opening block covering them.
+/// A batch of games is re-played in lockstep, one ply at a time, so that the
+/// moves of each ply are read out of a small contiguous region. Threads steal
+/// chunks of PlyChunkSize games, like in search_games().
+
+void search_plies(ScoutThread* th) {
+
+  const size_t BatchSize = 64;
+
+  struct Slot {
+    Board pos;
+    std::vector<Cursor> cursors;
+    GameResult result;
+    uint64_t gameIdx;
+    size_t active;
+  };
+
+  uint64_t gameOfs;
+  const Board& root = Shared.root;
+  Scout::Data& d = th->scout;
+  size_t lastPly = 0;
+  std::vector<Slot> slots(BatchSize);
+  size_t games = 0, movesCnt = 0, chunk;
+  bool done = false;
+
+  for (Slot& s : slots)
+      init_cursors(d, s.cursors);
+
+  for (const Query& q : d.queries)
+      lastPly = std::max(lastPly, size_t(q.maxPly));
+
+  assert(lastPly < d.plyCount);
+
+
+  // Opening block layout is a header of 4 uint64_t, the index of each game in
+  // the DB, the results and then the moves of the first plies of all the games.
+  Move* index = d.plyBase + OpeningHeaderSize;
+  Move* results = index + 4 * d.plyGames;
+  Move* plies = results + d.plyGames;
+
+  while (!done && (chunk = next_chunk(d)) < Shared.chunks)
+  {
+      // Terminate if all the queries have collected enough data
+      if (!open_chunk(d, chunk))
+          break;
+
+      if (th == Scouts.main())
+          report_progress();
+
+      // Skip the chunks that only approximate queries could need
+      if (!chunk_sampled(d))
+      {
+          close_chunk(d, games, movesCnt);
+          continue;
+      }
+
+      // Compute our chunk sub-range of games to search
+      size_t first = Shared.begin + chunk * PlyChunkSize;
+      size_t last = std::min(first + PlyChunkSize, size_t(d.plyGames));
+
+      for (size_t g = first; g < last; g += BatchSize)
+      {
+          size_t cnt = std::min(BatchSize, last - g), active = 0;
+
+          if (games == SampleGames)
+              reorder_rules(d);
+
+          games += cnt;
+
+          for (size_t i = 0; i < cnt; ++i)
+          {
+              Slot& s = slots[i];
+              s.pos = root;
+              s.result = GameResult(to_sq(results[g + i]));
+              s.active = 0;
+              read_be(s.gameIdx, (uint8_t*)(index + 4 * (g + i)));
+
+              for (Cursor& c : s.cursors)
+                  s.active += c.new_game(s.gameIdx);
+
+              active += !!s.active;
+              d.skippedCnt += !s.active;
+          }
+
+          // Terminate if all the queries have collected enough data
+          if (!active)
+          {
+              if (chunk_needed(d))
+                  continue;
+
+              done = true;
+              break;
+          }
+
+          for (size_t ply = 0; ply <= lastPly && active; ++ply)
+          {
+              Move* moves = plies + ply * d.plyGames + g;
+
+              for (size_t i = 0; i < cnt; ++i)
+              {
+                  Slot& s = slots[i];
+
+                  if (!s.active)
+                      continue;
+
+                  Move move = moves[i]; // Could be MOVE_NONE
+                  d.pliesCnt++;
+
+                  for (Cursor& c : s.cursors)
+                      if (c.active && !c.step(s.pos, move, s.result, ply))
+                          --s.active;
+
+                  if (!move || ply == lastPly)
+                      s.active = 0;
+
+                  if (!s.active)
+                  {
+                      d.skippedCnt += move && ply < lastPly;
+                      --active;
+                      continue;
+                  }
+
+                  s.pos.do_move(move);
+                  movesCnt++;
+              }
+          }
+
+          // Collect the matches in game order, as search_games() would do
+          for (size_t i = 0; i < cnt; ++i)
+              for (Cursor& c : slots[i].cursors)
+                  if (c.matched && !c.query->full)
+                  {
+                      read_be(gameOfs, (uint8_t*)(d.baseAddress + slots[i].gameIdx));
+                      add_match(c, slots[i].gameIdx, gameOfs);
+                  }
+      }
+
+      close_chunk(d, games, movesCnt);
+  }
+}
+
+
+/// search() re-play all the games and after each move look if the current
+/// position matches the requested rules.
+
+void search(ScoutThread* th) {
+
+  Scout::Data& d = th->scout;
+
+  for (Query& q : d.queries)
+      q.matches.reserve(q.limit ? q.skip + q.limit : 100000 / d.queries.size());
+
+  start_sampling(d);
+
+  if (d.plyBase)
+      search_plies(th);
+  else
+      search_games(th);
+
+  d.endTime = now();
+}
+
+
+/// search_begin() returns the index in the DB of the first game needed by the
+/// queries. A query resuming a previous search needs the games after the last
+/// one it returned, whose index is one less than the resume point.
+
+uint64_t search_begin(const Scout::Data& d) {
+
+  uint64_t begin = SIZE_MAX;
+
+  for (const Query& q : d.queries)
+      begin = std::min(begin, q.resume ? q.resume - 1 : 0);
+
+  return begin;
+}
+
+
+/// print_match() prints out in JSON format the offset of a matching game in the
+/// PGN file and its matching plies, without the enclosing braces.
+
+void print_match(const MatchingGame& m, std::ostream& os) {
+
+  os << "\"ofs\": " << m.gameOfs
+     << ", \"ply\": [";
+
+  std::string comma;
+  for (auto& p : m.plies)
+  {
+      os << comma << p;
+      comma = ", ";
+  }
+
+  os << "]";
+}
+
+
+/// stream_matches() is the output thread of a search with "stream". It prints
+/// the matches as NDJSON lines, one for each match, as soon as all the chunks
+/// before theirs are complete, so that matches are printed in DB order and skip
+/// and limit work as usual. Chunks starting from the first one not searched due
+/// to a stop are dropped, as print_query() does.
+
+void stream_matches(std::vector<std::pair<size_t, size_t>> pages, bool batch) {
+
+  std::vector<std::map<size_t, std::unique_ptr<StreamNode>>> pending(pages.size());
+  std::vector<size_t> next(pages.size(), 0);
+  bool done;
+
+  do {
+      done = Shared.streamDone; // Read before popping, to pop the last nodes too
+
+      StreamNode* n = Shared.streamHead.exchange(nullptr, std::memory_order_acquire);
+
+      while (n)
+      {
+          StreamNode* nextNode = n->next;
+          pending[n->query][n->chunk].reset(n);
+          n = nextNode;
+      }
+
+      std::ostringstream ss;
+
+      for (size_t i = 0; i < pages.size(); ++i)
+      {
+          size_t& skip = pages[i].first;
+          size_t& left = pages[i].second;
+
+          for (auto it = pending[i].find(next[i]);
+               it != pending[i].end() && next[i] < Shared.budgets[i].cutChunk;
+               it = pending[i].find(++next[i]))
+          {
+              for (const MatchingGame& m : it->second->matches)
+                  if (skip)
+                      skip--;
+
+                  else if (left)
+                  {
+                      left--;
+                      ss << "{ ";
+
+                      if (batch)
+                          ss << "\"query\": " << i << ", ";
+
+                      print_match(m, ss);
+                      ss << " }\n";
+                  }
+
+              pending[i].erase(it);
+          }
+      }
+
+      if (!ss.str().empty())
+          std::cout << IO_LOCK << ss.str() << std::flush << IO_UNLOCK;
+
+      if (!done)
+          std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+  } while (!done);
+}
+
+
+/// init_search() resets the state shared by the threads before a new search.
+/// If some query is approximate, the chunks are ranked in a random order, that
+/// is always the same for the same chunks, and each approximate query searches
+/// the ones ranked below its sample size.
+
+void init_search(const Scout::Data& d, const Position& pos) {
+
+  uint64_t begin = search_begin(d);
+
+  Shared.startTime = now();
+  Shared.root.set(pos);
+  Shared.nextChunk = Shared.doneChunks = 0;
+  Shared.progressInterval = Options["Progress Interval"];
+  Shared.lastProgress = 0;
+  Shared.begin = begin;
+
+  if (d.plyBase)
+  {
+      // Opening block stores the index of the games in DB order, look for the
+      // first one to search.
+      Move* index = d.plyBase + OpeningHeaderSize;
+      size_t lo = 0, hi = d.plyGames;
+      uint64_t gameIdx;
+
+      while (lo < hi)
+      {
+          size_t mid = (lo + hi) / 2;
+          read_be(gameIdx, (uint8_t*)(index + 4 * mid));
+
+          if (gameIdx < begin)
+              lo = mid + 1;
+          else
+              hi = mid;
+      }
+
+      Shared.begin = lo;
+      Shared.chunks = (d.plyGames - lo + PlyChunkSize - 1) / PlyChunkSize;
+  }
+  else
+      Shared.chunks = (d.dbSize - begin + GameChunkSize - 1) / GameChunkSize;
+
+  Shared.budgets.reset(new Budget[d.queries.size()]);
+
+  for (size_t i = 0; i < d.queries.size(); ++i)
+  {
+      const Query& q = d.queries[i];
+      Budget& b = Shared.budgets[i];
+
+      b.needed = q.limit ? q.skip + q.limit : 0;
+      b.settled = b.matches = 0;
+      b.counts.assign(b.needed ? Shared.chunks : 0, SIZE_MAX);
+      b.stopChunk = b.cutChunk = SIZE_MAX;
+      b.sampled = q.sample > 0 ? std::max(size_t(1), size_t(std::ceil(q.sample * Shared.chunks)))
+                               : Shared.chunks;
+  }
+
+  if (d.stream)
+  {
+      std::vector<std::pair<size_t, size_t>> pages; // Skip and limit of each query
+
+      for (const Query& q : d.queries)
+          pages.push_back(std::make_pair(q.skip, q.limit ? q.limit : SIZE_MAX));
+
+      Shared.streamHead = nullptr;
+      Shared.streamDone = false;
+      Shared.streamer = std::thread(stream_matches, pages, d.batch);
+  }
+
+  Shared.ranks.clear();
+
+  if (std::none_of(d.queries.begin(), d.queries.end(), [](const Query& q) {
+                   return q.sample > 0; }))
+      return;
+
+  PRNG rng(SampleSeed);
+  std::vector<size_t> order(Shared.chunks);
+
+  for (size_t i = 0; i < order.size(); ++i)
+      order[i] = i;
+
+  for (size_t i = order.size(); i > 1; --i)
+      std::swap(order[i - 1], order[rng.rand<uint64_t>() % i]);
+
+  Shared.ranks.resize(Shared.chunks);
+
+  for (size_t i = 0; i < order.size(); ++i)
+      Shared.ranks[order[i]] = i;
+}
+
+
+/// DBHandle is a DB kept memory-mapped between queries by the 'open' command,
+/// together with its opening block if up to date, so that queries do not pay
+/// the mapping and the page tables warmup each time. Open DBs are keyed by full
+/// path, so that any name of the same file, e.g. "./x.scout", finds it.
+
+struct DBHandle {
+  void* baseAddress;
+  void* plyBase; // nullptr if no opening block
+  uint64_t dbMapping, dbSize, plyMapping;
+};
+
+std::map<std::string, DBHandle> OpenDBs;
+
+
+/// opening_name() returns the file name of the opening block of a DB
+
+std::string opening_name(std::string dbName) {
+
+  size_t lastdot = dbName.find_last_of(".");
+  if (lastdot != std::string::npos)
+      dbName = dbName.substr(0, lastdot);
+  return dbName + ".opening";
+}
+
+
+/// map_opening() memory-maps the opening block of the DB, if one exists and is
+/// up to date, i.e. built out of a DB of the same size and modification time,
+/// otherwise returns nullptr.
+
+void* map_opening(const std::string& dbName, uint64_t dbSize, uint64_t* mapping, uint64_t* size) {
+
+  std::string blockName = opening_name(dbName);
+  uint64_t blockDbSize = 0, blockDbTime = 0;
+  void* baseAddress;
+
+  if (!std::ifstream(blockName))
+      return nullptr;
+
+  mem_map(blockName.c_str(), &baseAddress, mapping, size);
+
+  if (*size >= OpeningHeaderSize * sizeof(Move))
+  {
+      uint8_t* data = (uint8_t*)baseAddress + 2 * sizeof(uint64_t);
+      read_be(blockDbTime, read_be(blockDbSize, data));
+  }
+
+  if (blockDbSize != dbSize || blockDbTime != file_time(dbName.c_str()))
+  {
+      mem_unmap(baseAddress, *mapping);
+      return nullptr;
+  }
+
+  return baseAddress;
+}
+
+
+/// map_opening_block() sets the ply-major opening block of the DB to be used by
+/// the queries, if one is available and covers all the plies they request. It
+/// is mapped now, unless the DB is open.
+
+void map_opening_block(Scout::Data& d, const std::string& dbName) {
+
+  uint64_t games, plies, size;
+  void* baseAddress;
+  int maxPly = -1;
+
+  for (const Query& q : d.queries)
+      if (q.maxPly < 0)
+          return;
+      else
+          maxPly = std::max(maxPly, q.maxPly);
+
+  if (maxPly < 0)
+      return;
+
+  if (d.persistent)
+  {
+      const DBHandle& h = OpenDBs[full_path(dbName)];
+      baseAddress = h.plyBase;
+      d.plyMapping = h.plyMapping;
+  }
+  else
+      baseAddress = map_opening(dbName, d.dbSize, &d.plyMapping, &size);
+
+  if (!baseAddress)
+      return;
+
+  uint8_t* data = (uint8_t*)baseAddress;
+  data = read_be(games, data);
+  read_be(plies, data);
+
+  if (size_t(maxPly) >= plies)
+  {
+      if (!d.persistent)
+          mem_unmap(baseAddress, d.plyMapping);
+      return;
+  }
+
+  d.plyBase = (Move*)baseAddress;
+  d.plyGames = games;
+  d.plyCount = plies;
+}
+
+
+/// release_db() unmaps the DB and the opening block used by the queries, unless
+/// they are owned by an open DB.
+
+void release_db(const Scout::Data& d) {
+
+  if (d.persistent)
+      return;
+
+  mem_unmap(d.baseAddress, d.dbMapping);
+
+  if (d.plyBase)
+      mem_unmap(d.plyBase, d.plyMapping);
+}
+
+
+/// open_db() is called when engine receives the "open" command. It maps the DB
+/// and its opening block, if any, and keeps them mapped until "close", hinting
+/// the OS to read them ahead. A DB already open is mapped again, e.g. to pick
+/// up a rebuilt opening block.
+
+void open_db(const std::string& dbName) {
+
+  DBHandle h;
+  uint64_t size;
+
+  close_db(dbName);
+
+  mem_map(dbName.c_str(), &h.baseAddress, &h.dbMapping, &h.dbSize);
+  mem_advise(h.baseAddress, h.dbSize);
+
+  h.plyBase = map_opening(dbName, h.dbSize / sizeof(Move), &h.plyMapping, &size);
+
+  if (h.plyBase)
+      mem_advise(h.plyBase, size);
+
+  OpenDBs[full_path(dbName)] = h;
+}
+
+
+/// close_db() unmaps an open DB, once any running scout is done with it.
+/// Returns false if the DB was not open.
+
+bool close_db(const std::string& dbName) {
+
+  auto it = OpenDBs.find(full_path(dbName));
+
+  if (it == OpenDBs.end())
+      return false;
+
+  Scouts.main()->wait_for_search_finished();
+
+  mem_unmap(it->second.baseAddress, it->second.dbMapping);
+
+  if (it->second.plyBase)
+      mem_unmap(it->second.plyBase, it->second.plyMapping);
+
+  OpenDBs.erase(it);
+  return true;
+}
+
+
+/// map_db() sets the DB to be searched by the queries: the mappings of the DB
+/// if open, otherwise the DB is mapped now and unmapped once searched.
+
+void map_db(Scout::Data& d, const std::string& dbName) {
+
+  uint64_t mapping, size;
+  void* baseAddress;
+  auto it = OpenDBs.find(full_path(dbName));
+
+  if (it != OpenDBs.end())
+  {
+      baseAddress = it->second.baseAddress;
+      mapping = it->second.dbMapping;
+      size = it->second.dbSize;
+      d.persistent = true;
+  }
+  else
+      mem_map(dbName.c_str(), &baseAddress, &mapping, &size);
+
+  d.baseAddress = (Move*)baseAddress;
+  d.dbMapping = mapping;
+  d.dbSize = size / sizeof(Move);
+}
+
+
+/// estimate_plan() fills the estimated games and plies to replay with a plan,
+/// given the number of games in the DB and their average length, and its cost.
+/// Cost is in units of rule checks: each replayed ply checks the first
+/// condition of each query, and the moves read but not replayed, e.g. after a
+/// match, cost a fraction of a check.
+
+void estimate_plan(const Scout::Data& d, Plan& plan, uint64_t games, uint64_t length, uint64_t reads) {
+
+  uint64_t plies = 0, checks = 1; // Replaying the move costs as a check
+
+  // A game is replayed until the last query is done with it
+  for (const Query& q : d.queries)
+  {
+      plies = std::max(plies, q.maxPly >= 0 ? std::min(length, uint64_t(q.maxPly) + 1) : length);
+      checks += q.conditions[0].rules.size() - 1; // Terminating rule excluded
+  }
+
+  // Resumed searches start from a later game
+  double left = d.dbSize ? 1.0 - double(search_begin(d)) / d.dbSize : 0;
+
+  plan.valid = true;
+  plan.games = uint64_t(games * left);
+  plan.plies = plan.games * plies;
+  plan.cost = plan.plies * checks + uint64_t(reads * left) / SkipCostDiv;
+}
+
+
+/// plan_query() is the query planner: it estimates the cost of each available
+/// way to search the DB and picks the cheapest one. A full scan is always
+/// possible, the opening block only if usable. The length of the games is
+/// estimated out of the first chunk of the DB, and so their number, unless the
+/// opening block stores it.
+
+void plan_query(Scout::Data& d, const std::string& dbName) {
+
+  Move* data = d.baseAddress;
+  Move* end = data + std::min(d.dbSize, GameChunkSize);
+  uint64_t games = 0;
+
+  for ( ; data < end; data = next_game(data))
+      games++;
+
+  uint64_t sampled = data - d.baseAddress;
+  uint64_t length = games ? sampled / games - 6 : 0;
+
+  if (sampled)
+      games = games * d.dbSize / sampled;
+
+  map_opening_block(d, dbName);
+
+  estimate_plan(d, d.plans[PlanScan], d.plyBase ? d.plyGames : games, length, d.dbSize);
+  d.plan = PlanScan;
+
+  if (!d.plyBase)
+      return;
+
+  // Index and result of each game are read, then the moves up to the max-ply
+  int maxPly = 0;
+
+  for (const Query& q : d.queries)
+      maxPly = std::max(maxPly, q.maxPly);
+
+  estimate_plan(d, d.plans[PlanOpening], d.plyGames, length, d.plyGames * (maxPly + 6));
+
+  if (d.plans[PlanOpening].cost <= d.plans[PlanScan].cost)
+      d.plan = PlanOpening;
+  else
+  {
+      if (!d.persistent)
+          mem_unmap(d.plyBase, d.plyMapping);
+      d.plyBase = nullptr;
+  }
+}
+
+
+/// explain() prints the plan chosen for the queries, together with the other
+/// available ones, then releases the DB without searching it.
+
+void explain(const Scout::Data& d) {
+
+  std::string tab = "\n    ";
+  std::string indent4 = "    ";
+
+  auto print = [&](PlanType pt) {
+      const Plan& p = d.plans[pt];
+      std::cout << "\"plan\": \"" << PlanNames[pt] << "\""
+                << ", \"games\": " << p.games
+                << ", \"plies\": " << p.plies
+                << ", \"cost\": " << p.cost;
+  };
+
+  std::cout << "{" << tab;
+  print(d.plan);
+  std::cout << "," << tab << "\"alternatives\": [";
+
+  std::string comma;
+  for (PlanType pt = PlanScan; pt < PLAN_NB; pt = PlanType(pt + 1))
+      if (pt != d.plan && d.plans[pt].valid)
+      {
+          std::cout << comma << tab << indent4 << "{ ";
+          print(pt);
+          std::cout << " }";
+          comma = ",";
+      }
+
+  std::cout << (comma.empty() ? "]" : tab + "]") << "\n}" << std::endl;
+
+  release_db(d);
+}
+
+
+/// group_name() returns the printable name of a group of matches
+
+std::string group_name(const Query& q, uint64_t key) {
+
+  std::string str;
+
+  switch (q.groupBy) {
+  case GroupResult:
+      return ResultNames[std::min(key, uint64_t(Invalid))];
+
+  case GroupSideToMove:
+      return key == WHITE ? "white" : "black";
+
+  case GroupPly:
+      return std::to_string(key * q.plyBucket) + "-" + std::to_string((key + 1) * q.plyBucket - 1);
+
+  case GroupNextMove:
+      return UCI::move(Move(key), false);
+
+  case GroupMaterial:
+      for (Color c = WHITE; c <= BLACK; ++c)
+      {
+          str += 'K';
+
+          for (PieceType pt = QUEEN; pt >= PAWN; --pt)
+              str += std::string((key >> (4 * (5 * c + pt - PAWN))) & 15, PieceToChar[pt]);
+      }
+      return str;
+
+  default:
+      return str;
+  }
+}
+
+
+/// print_estimate() prints the estimated matches of an approximate query in the
+/// whole DB, with a 95% confidence interval and the fraction of the DB sampled.
+/// Sampling units are the chunks, weighted by their size in moves, or in games
+/// for the opening block, so the estimate is the ratio of matches to size in
+/// the sample, times the size of the DB.
+
+void print_estimate(size_t idx, size_t found, std::ostream& os) {
+
+  const Scout::Data& d = Scouts.main()->scout;
+  size_t unit = d.plyBase ? PlyChunkSize : GameChunkSize;
+  size_t total = (d.plyBase ? d.plyGames : d.dbSize) - Shared.begin;
+  std::vector<std::pair<size_t, size_t>> samples;
+
+  for (ScoutThread* th : Scouts)
+  {
+      const auto& s = th->scout.queries[idx].samples;
+      samples.insert(samples.end(), s.begin(), s.end());
+  }
+
+  auto size = [&](size_t chunk) { return double(std::min(unit, total - chunk * unit)); };
+
+  double n = double(samples.size()), N = double(Shared.chunks), x = 0, y = 0;
+
+  for (const auto& s : samples)
+      x += size(s.first), y += double(s.second);
+
+  double ratio = x > 0 ? y / x : 0, estimate = ratio * total, se = 0;
+
+  if (n > 1)
+  {
+      double var = 0;
+
+      for (const auto& s : samples)
+          var += std::pow(s.second - ratio * size(s.first), 2) / (n - 1);
+
+      se = N * std::sqrt((1 - n / N) * var / n);
+  }
+  else if (n > 0 && n < N) // With a single chunk assume Poisson distributed matches
+      se = std::sqrt(y) * total / x;
+
+  os << "{ \"estimate\": " << std::llround(estimate)
+     << ", \"low\": " << std::max(uint64_t(found), uint64_t(std::llround(std::max(estimate - 1.96 * se, 0.0))))
+     << ", \"high\": " << std::llround(estimate + 1.96 * se)
+     << ", \"sampled\": " << (total ? x / total : 1.0) << " }";
+}
+
+
+/// print_profile() prints, for each condition of a profiled query, the calls,
+/// passes and cycles of each rule, summed over all the threads, and apart the
+/// ones of the sampling, that evaluates all the rules, and the cost of the
+/// sub-fen index, if any. Then, for each thread, the elapsed time, the games
+/// searched, the ones not replayed to the end and the positions checked.
+
+void print_profile(size_t idx, std::ostream& os) {
+
+  const Query& q = Scouts.main()->scout.queries[idx];
+  std::string tab = "\n        ";
+  std::string indent4 = "    ";
+
+  os << "{"
+     << tab << "\"conditions\": [";
+
+  std::string comma1;
+  for (size_t i = 0; i < q.conditions.size(); ++i)
+  {
+      const Condition& cond = q.conditions[i];
+      RuleStats total[RuleMatchedQuery + 1] = {}, sampled[RuleMatchedQuery + 1] = {};
+
+      // Each thread has its own rule order
+      for (ScoutThread* th : Scouts)
+      {
+          const Condition& tc = th->scout.queries[idx].conditions[i];
+
+          for (size_t r = 0; r + 1 < tc.rules.size(); ++r)
+          {
+              total[tc.rules[r]].calls  += tc.profileStats[r].calls;
+              total[tc.rules[r]].passes += tc.profileStats[r].passes;
+              total[tc.rules[r]].cycles += tc.profileStats[r].cycles;
+              sampled[tc.rules[r]].calls  += tc.stats[r].calls;
+              sampled[tc.rules[r]].passes += tc.stats[r].passes;
+              sampled[tc.rules[r]].cycles += tc.stats[r].cycles;
+          }
+      }
+
+      os << comma1 << tab << indent4 << "{ \"rules\": [";
+
+      std::string comma2;
+      for (size_t r = 0; r + 1 < cond.rules.size(); ++r)
+      {
+          const RuleStats& st = total[cond.rules[r]];
+          const RuleStats& ss = sampled[cond.rules[r]];
+
+          os << comma2 << tab << indent4 << indent4
+             << "{ \"rule\": \"" << RuleNames[cond.rules[r]] << "\""
+             << ", \"calls\": " << st.calls
+             << ", \"passes\": " << st.passes
+             << ", \"cycles\": " << st.cycles
+             << ", \"sampling\": { \"calls\": " << ss.calls
+             << ", \"passes\": " << ss.passes
+             << ", \"cycles\": " << ss.cycles
+             << " } }";
+          comma2 = ", ";
+      }
+
+      os << " ]";
+
+      const SubFenIndex& index = cond.subfenIndex;
+      const RuleStats& st = total[RuleSubFen];
+
+      if (!index.nodes.empty())
+          os << ","
+             << tab << indent4 << indent4
+             << "\"sub-fen index\": { \"patterns\": " << index.size
+             << ", \"nodes\": " << index.nodes.size()
+             << ", \"leaves\": " << index.leaves
+             << ", \"depth\": " << index.depth
+             << ", \"build cycles\": " << index.buildCycles
+             << ", \"lookup cycles\": " << (st.calls ? st.cycles / st.calls : 0)
+             << " }";
+
+      os << " }";
+      comma1 = ", ";
+  }
+
+  os << tab << "],"
+     << tab << "\"threads\": [";
+
+  comma1.clear();
+  for (ScoutThread* th : Scouts)
+  {
+      const Scout::Data& d = th->scout;
+
+      os << comma1 << tab << indent4
+         << "{ \"elapsed (ms)\": " << d.endTime - Shared.startTime
+         << ", \"games\": " << d.gamesCnt
+         << ", \"skipped games\": " << d.skippedCnt
+         << ", \"plies\": " << d.pliesCnt
+         << " }";
+      comma1 = ", ";
+  }
+
+  os << tab << "]"
+     << "\n    }";
+}
+
+
+/// cut_resume() returns the resume point of a query cut at the given chunk, so
+/// that the search continues from the first game of the chunk: one past the
+/// index of the last game before it, see search_begin(). It is 0 for the first
+/// chunk, that is where the search started.
+
+uint64_t cut_resume(const Scout::Data& d, size_t chunk) {
+
+  if (!chunk)
+      return 0;
+
+  if (d.plyBase)
+  {
+      uint64_t gameIdx;
+      read_be(gameIdx, (uint8_t*)(d.plyBase + OpeningHeaderSize + 4 * (Shared.begin + chunk * PlyChunkSize - 1)));
+      return gameIdx + 1;
+  }
+
+  // Walk the games of the previous chunk, as search_games() finds them, up to
+  // the last one.
+  Move* data = d.baseAddress + Shared.begin + (chunk - 1) * GameChunkSize;
+  Move* first = detect_next_game(data + GameChunkSize);
+  Move* game = chunk > 1 ? detect_next_game(data) : data;
+
+  for (Move* next = game; next < first; next = next_game(game))
+      game = next;
+
+  return game - d.baseAddress + 1;
+}
+
+
+/// print_query() prints out in JSON format the results of the query with the
+/// given index, collecting the matches out of the threads. The statistics of
+/// the search go to 'head', the rest, that is the same each time the query is
+/// run on the same DB, to 'os'. Returns the match count.
+
+size_t print_query(size_t idx, size_t cnt, TimePoint elapsed, std::ostream& head, std::ostream& os) {
+
+  const Query& q = Scouts.main()->scout.queries[idx];
+  bool stream = Scouts.main()->scout.stream;
+  size_t cutChunk = Shared.budgets[idx].cutChunk;
+  size_t matches = 0;
+
+  // A stopped query continues from the first chunk not searched, if not
+  // resuming after it.
+  uint64_t resume = cutChunk == SIZE_MAX ? 0
+                  : std::max(cut_resume(Scouts.main()->scout, cutChunk), q.resume);
+
+  // Threads store the matches of each chunk they searched one after the other,
+  // sort the chunks to print the matches in DB order. If the query has been
+  // stopped, no chunk from the first one not searched on has been searched, so
+  // matches, counts and groups are the ones of the chunks before it.
+  struct Span { size_t chunk; const MatchingGame *begin, *end; };
+  std::vector<Span> spans;
+
+  for (ScoutThread* th : Scouts)
+  {
+      const Query& tq = th->scout.queries[idx];
+      size_t begin = 0;
+
+      for (const auto& c : tq.chunks)
+      {
+          if (c.first < cutChunk)
+          {
+              spans.push_back({c.first, tq.matches.data() + begin, tq.matches.data() + c.second});
+              matches += c.second - begin;
+          }
+          begin = c.second;
+      }
+
+      if (q.output == OutputCount)
+          matches += tq.count;
+  }
+
+  std::sort(spans.begin(), spans.end(), [](const Span& a, const Span& b) {
+                return a.chunk < b.chunk; });
+
+  size_t skip = q.skip;
+  matches = matches > skip ? matches - skip : 0;
+
+  if (q.limit)
+      matches = std::min(matches, q.limit);
+
+  size_t count = matches;
+
+  std::string tab = "\n    ";
+  std::string indent4 = "    ";
+  head << "{"
+       << tab << "\"moves\": " << cnt << ","
+       << tab << "\"match count\": " << matches << ",";
+
+  if (cutChunk != SIZE_MAX)
+      head << tab << "\"complete\": false,";
+
+  head << tab << "\"moves/second\": " << 1000 * cnt / elapsed << ","
+       << tab << "\"processing time (ms)\": " << elapsed << ","
+       << tab << "\"idle time (ms)\": [";
+
+  // Time spent by each thread waiting for the slowest one to finish
+  TimePoint last = 0;
+  for (ScoutThread* th : Scouts)
+      last = std::max(last, th->scout.endTime);
+
+  for (ScoutThread* th : Scouts)
+      head << (th == Scouts.main() ? "" : ", ") << last - th->scout.endTime;
+
+  head << "],";
+  os << tab << "\"rule order\": [";
+
+  // Rules order chosen by main thread after sampling
+  std::string comma1;
+  for (const Condition& cond : q.conditions)
+  {
+      os << comma1 << "[";
+
+      std::string comma2;
+      for (size_t i = 0; i + 1 < cond.rules.size(); ++i)
+      {
+          os << comma2 << "\"" << RuleNames[cond.rules[i]] << "\"";
+          comma2 = ", ";
+      }
+
+      os << "]";
+      comma1 = ", ";
+  }
+
+  os << "]";
+
+  if (q.profile)
+  {
+      os << "," << tab << "\"profile\": ";
+      print_profile(idx, os);
+  }
+
+  if (q.sample > 0)
+  {
+      os << "," << tab << "\"approximate\": ";
+      print_estimate(idx, matches, os);
+  }
+
+  // Aggregates print the groups, merging the counters of all the threads, most
+  // populated groups first.
+  if (q.output == OutputCount)
+  {
+      if (q.groupBy)
+      {
+          std::unordered_map<uint64_t, size_t> groups;
+
+          for (ScoutThread* th : Scouts)
+              for (const auto& g : th->scout.queries[idx].groups)
+                  groups[g.first] += g.second;
+
+          std::vector<std::pair<std::string, size_t>> sorted;
+
+          for (const auto& g : groups)
+              sorted.push_back(std::make_pair(group_name(q, g.first), g.second));
+
+          std::sort(sorted.begin(), sorted.end(), [](const std::pair<std::string, size_t>& a,
+                                                     const std::pair<std::string, size_t>& b) {
+                        return a.second != b.second ? a.second > b.second : a.first < b.first; });
+
+          os << "," << tab << "\"groups\":"
+             << tab << "[";
+
+          comma1.clear();
+          for (const auto& g : sorted)
+          {
+              os << comma1 << tab << indent4
+                 << "{ \"key\": \"" << g.first << "\", \"count\": " << g.second << " }";
+              comma1 = ", ";
+          }
+
+          os << tab << "]";
+      }
+
+      if (cutChunk != SIZE_MAX)
+          os << "," << tab << "\"resume token\": \""
+             << std::hex << resume << std::dec << "\"";
+
+      os << "\n}";
+      return count;
+  }
+
+  // Streamed matches have been printed already, see stream_matches()
+  if (!stream)
+      os << "," << tab << "\"matches\":"
+         << tab << "[";
+
+  const MatchingGame* lastMatch = nullptr;
+  size_t page = matches;
+
+  comma1.clear();
+  for (const Span& span : spans)
+  {
+      for (const MatchingGame* m = span.begin; m != span.end; ++m)
+      {
+          if (skip)
+          {
+              skip--;
+              continue;
+          }
+
+          if (matches <= 0)
+              break;
+
+          matches--;
+          lastMatch = m;
+
+          if (stream)
+              continue;
+
+          os << comma1 << tab << indent4 << "{ ";
+          print_match(*m, os);
+          os << " }";
+          comma1 = ", ";
+      }
+
+      if (matches <= 0)
+          break;
+  }
+
+  if (!stream)
+      os << tab << "]";
+
+  // A full page may be followed by more matches: the resume token allows to
+  // continue the search just after the last game of the page.
+  bool full = q.limit && page == q.limit && lastMatch;
+
+  if (full)
+      resume = lastMatch->gameIdx + 1;
+
+  if (full || cutChunk != SIZE_MAX)
+      os << "," << tab << "\"resume token\": \""
+         << std::hex << resume << std::dec << "\"";
+
+  os << "\n}";
+
+  return count;
+}
+
+
+/// CachedResult is the output of a scout, but for the statistics of the search:
+/// the match count and the rest of the output of each query. Results are kept
+/// in LRU order, most recently used first, within the size set by the "Result
+/// Cache" option, in MB. The key is made of the DB full path and identity, the
+/// root position and the canonical JSON of the queries, so a changed DB misses
+/// it.
+
+struct CachedResult {
+  std::string key;
+  std::vector<std::pair<size_t, std::string>> queries; // Match count, output
+  size_t size;
+};
+
+std::list<CachedResult> Cache;
+std::unordered_map<std::string, std::list<CachedResult>::iterator> CacheIndex;
+size_t CacheSize;
+
+
+/// db_identity() returns the size and modification time of the DB and of its
+/// opening block, that change when they are rebuilt or appended to.
+
+std::string db_identity(const std::string& dbName) {
+
+  std::string id;
+  struct stat st;
+
+  for (const std::string& fname : { dbName, opening_name(dbName) })
+      id += stat(fname.c_str(), &st) ? "- " :   std::to_string(st.st_size) + " "
+                                              + std::to_string(st.st_mtime) + " ";
+  return id;
+}
+
+
+/// evict_results() drops the cached results whose key begins with the given
+/// prefix, but not with the given exception, then the least recently used ones
+/// until the cache fits in the given size.
+
+void evict_results(const std::string& prefix, const std::string& keep, size_t maxSize) {
+
+  for (auto it = Cache.begin(); it != Cache.end(); )
+      if (   !prefix.empty()
+          && !it->key.compare(0, prefix.size(), prefix)
+          && (keep.empty() || it->key.compare(0, keep.size(), keep)))
+      {
+          CacheSize -= it->size;
+          CacheIndex.erase(it->key);
+          it = Cache.erase(it);
+      }
+      else
+          ++it;
+
+  while (CacheSize > maxSize)
+  {
+      CacheSize -= Cache.back().size;
+      CacheIndex.erase(Cache.back().key);
+      Cache.pop_back();
+  }
+}
+
+
+/// cache_result() stores the result of the queries just searched, unless too
+/// big for the cache.
+
+void cache_result(CachedResult& r) {
+
+  size_t maxSize = size_t(Options["Result Cache"]) << 20;
+
+  r.size = sizeof(CachedResult) + 2 * r.key.size(); // Key is in the index too
+
+  for (const auto& q : r.queries)
+      r.size += sizeof(q) + q.second.size();
+
+  if (r.size > maxSize || CacheIndex.count(r.key))
+      return;
+
+  evict_results("", "", maxSize - r.size);
+
+  Cache.push_front(std::move(r));
+  CacheIndex[Cache.front().key] = Cache.begin();
+  CacheSize += Cache.front().size;
+}
+
+
+/// one_line() joins the lines of a JSON text, dropping the indentation
+
+std::string one_line(const std::string& s) {
+
+  std::string line;
+
+  for (size_t i = 0; i < s.size(); ++i)
+      if (s[i] != '\n')
+          line += s[i];
+      else
+      {
+          line += ' ';
+          while (i + 1 < s.size() && s[i + 1] == ' ')
+              i++;
+      }
 
-                  bool ok = true;
-                  for (const auto& p : f->pieces)
-                      if ((pos.pieces(p.first) & p.second) != p.second)
-                      {
-                          ok = false;
-                          break;
-                      }
+  return line;
+}
 
-                  if (ok)
-                      goto NextRule;
-              }
-              break;
 
-          case RuleMaterial:
-              if (std::find(cond->matKeys.begin(), cond->matKeys.end(),
-                            pos.material_key()) != cond->matKeys.end())
-                  goto NextRule;
-              break;
+/// print_results() collect info out of the threads at the end of the search
+/// and print it out in JSON format. A batch of queries is printed as a JSON
+/// array, with one result object for each query. Output is locked, so that it
+/// is not mixed with the one of an engine search running at the same time.
 
-          case RuleImbalance:
-              for (const Imbalance& imb : cond->imbalances)
-                  if (   imb.nonPawnMaterial ==  pos.non_pawn_material(WHITE)
-                                               - pos.non_pawn_material(BLACK)
-                      && imb.pawnCount ==  pos.count<PAWN>(WHITE)
-                                         - pos.count<PAWN>(BLACK))
-                      goto NextRule;
-              break;
+void print_results() {
 
-          case RuleMove:
-              if (cond->moveSquares & to_sq(move))
-                  for (const ScoutMove& m : cond->moves)
-                  {
-                      if (   pos.moved_piece(move) != m.pc
-                          || to_sq(move) != m.to
-                          || m.castle != (type_of(move) == CASTLING)
-                          || !from_sq_ok(m.disambiguation, from_sq(move)))
-                          continue;
-                      goto NextRule;
-                  }
-              break;
+  TimePoint elapsed = now() - Shared.startTime + 1;
+  const Scout::Data& d = Scouts.main()->scout;
+  size_t cnt = 0;
 
-          case RuleQuietMove:
-              if (move && !pos.capture(move))
-                  goto NextRule;
-              break;
+  for (ScoutThread* th : Scouts)
+      cnt += th->scout.movesCnt;
 
-          case RuleCapturedPiece:
-              if (move && pos.capture(move))
-              {
-                  PieceType pt = type_of(move) == NORMAL ? type_of(pos.piece_on(to_sq(move))) : PAWN;
-                  if (cond->capturedFlags & (1 << int(pt)))
-                      goto NextRule;
-              }
-              break;
+  if (d.stream)
+  {
+      Shared.streamDone = true;
+      Shared.streamer.join();
+  }
 
-          case RuleMovedPiece:
-              if (move && (cond->movedFlags & (1 << int(type_of(pos.moved_piece(move))))))
-                  goto NextRule;
-              break;
+  std::cout << IO_LOCK;
 
-          case RuleWhite:
-              if (pos.side_to_move() == WHITE)
-                  goto NextRule;
-              break;
+  if (d.batch && !d.stream)
+      std::cout << "[\n";
 
-          case RuleBlack:
-              if (pos.side_to_move() == BLACK)
-                  goto NextRule;
-              break;
+  CachedResult r;
+  bool complete = true;
+
+  for (size_t i = 0; i < d.queries.size(); ++i)
+  {
+      std::ostringstream head, os;
+      size_t count = print_query(i, cnt, elapsed, head, os);
 
-          case RuleMatchedCondition:
-              assert(condIdx + 1 < d.conditions.size());
+      // When streaming, the result of each query is a summary NDJSON line
+      if (d.stream)
+      {
+          std::string line = one_line(head.str() + os.str());
 
-              matchPlies.push_back(pos.nodes_searched());
-              set_condition(++condIdx);
-              break; // Skip to next move
+          if (d.batch)
+              line.insert(2, "\"query\": " + std::to_string(i) + ", ");
 
-          case RuleMatchedQuery:
-              assert(condIdx + 1 == d.conditions.size());
+          std::cout << (i ? "\n" : "") << line;
+      }
+      else
+          std::cout << (i ? ",\n" : "") << head.str() << os.str();
 
-              matchPlies.push_back(pos.nodes_searched());
-              read_be(gameOfs, (uint8_t*)gameOfsPtr);
-              d.matches.push_back({gameOfs, matchPlies});
-              matchPlies.clear(); // Needed for single conditon case
+      r.queries.emplace_back(count, os.str());
+      complete &= Shared.budgets[i].cutChunk == SIZE_MAX;
+  }
 
-              // Terminate if we have collected more then enough data
-              if (maxMatches && d.matches.size() >= maxMatches)
-                  data = end - 2;
-SkipToNextGame:
-              // Skip to the end of the game after the first match
-              while (*data != MOVE_NONE)
-                  ++data;
-              break;
-          }
+  if (d.batch && !d.stream)
+      std::cout << "\n]";
 
-          // Do the move after rule checking
-          if (move)
-              pos.do_move(move, *st++, pos.gives_check(move));
+  std::cout << std::endl << IO_UNLOCK;
 
-      } while (*data++ != MOVE_NONE); // Exit the game loop pointing to next ofs
+  // The resume token of a stopped query is read out of the DB
+  release_db(d);
 
-      // Can't use pos.nodes_searched() due to skipping moves after a match
-      d.movesCnt += data - gameOfsPtr - 6; // 4+1+1 for ofs, result and MOVE_NONE
+  // Partial results of stopped queries are not cached
+  if (!d.key.empty() && complete)
+  {
+      r.key = d.key;
+      cache_result(r);
   }
-
 }
 
 
-/// print_results() collect info out of the threads at the end of the search
-/// and print it out in JSON format.
+/// find_result() looks up the cache for the result of the queries on the DB
+/// and, if found, prints it and releases the DB. Otherwise sets the key to
+/// store the result once searched, unless the cache is disabled, a query is
+/// profiled, because profiles are about the search, or streamed.
 
-void print_results(const Search::LimitsType& limits) {
+bool find_result(Scout::Data& d, const std::string& dbName, const Position& pos) {
 
-  TimePoint elapsed = now() - limits.startTime + 1;
-  Scout::Data d = Threads.main()->scout;
-  size_t cnt = 0, matches = 0;
+  size_t maxSize = size_t(Options["Result Cache"]) << 20;
 
-  mem_unmap(d.baseAddress, d.dbMapping);
+  // Cache is updated at the end of a scout
+  Scouts.main()->wait_for_search_finished();
+
+  TimePoint elapsed = now();
+
+  std::string prefix = full_path(dbName) + "\n";
+  std::string id = prefix + db_identity(dbName) + "\n";
+
+  evict_results(prefix, id, maxSize);
 
-  for (Thread* th : Threads)
+  if (!maxSize || std::any_of(d.queries.begin(), d.queries.end(), [](const Query& q) {
+                                  return q.profile; }) || d.stream)
   {
-      cnt += th->scout.movesCnt;
-      matches += th->scout.matches.size();
+      d.key.clear();
+      return false;
   }
 
-  size_t skip = d.skip;
-  matches -= skip;
-
-  if (d.limit)
-      matches = std::min(matches, d.limit);
+  d.key = id + pos.fen() + "\n" + d.key;
 
-  std::string tab = "\n    ";
-  std::string indent4 = "    ";
-  std::cout << "{"
-            << tab << "\"moves\": " << cnt << ","
-            << tab << "\"match count\": " << matches << ","
-            << tab << "\"moves/second\": " << 1000 * cnt / elapsed << ","
-            << tab << "\"processing time (ms)\": " << elapsed << ","
-            << tab << "\"matches\":"
-            << tab << "[";
+  auto it = CacheIndex.find(d.key);
+  if (it == CacheIndex.end())
+      return false;
 
-  std::string comma1;
-  for (Thread* th : Threads)
-  {
-      for (auto& m : th->scout.matches)
-      {
-          if (skip)
-          {
-              skip--;
-              continue;
-          }
+  Cache.splice(Cache.begin(), Cache, it->second); // Now the most recently used
+  release_db(d);
+  elapsed = now() - elapsed + 1;
 
-          if (matches <= 0)
-              break;
+  std::string tab = "\n    ";
+  std::cout << IO_LOCK;
+
+  if (d.batch)
+      std::cout << "[\n";
+
+  for (size_t i = 0; i < Cache.front().queries.size(); ++i)
+      std::cout << (i ? ",\n" : "") << "{"
+                << tab << "\"moves\": 0,"
+                << tab << "\"match count\": " << Cache.front().queries[i].first << ","
+                << tab << "\"cached\": true,"
+                << tab << "\"moves/second\": 0,"
+                << tab << "\"processing time (ms)\": " << elapsed << ","
+                << tab << "\"idle time (ms)\": [],"
+                << Cache.front().queries[i].second;
+
+  if (d.batch)
+      std::cout << "\n]";
+
+  std::cout << std::endl << IO_UNLOCK;
+  return true;
+}
 
-          matches--;
-          std::cout << comma1 << tab << indent4
-                    << "{ \"ofs\": " << m.gameOfs
-                    << ", \"ply\": [";
 
-          std::string comma2;
-          for (auto& p : m.plies)
-          {
-              std::cout << comma2 << p;
-              comma2 = ", ";
-          }
+/// clear_results() drops the cached results of the queries on the DB, e.g. when
+/// it is going to be rewritten.
 
-          std::cout << "] }";
-          comma1 = ", ";
-      }
+void clear_results(const std::string& dbName) {
 
-      if (matches <= 0)
-          break;
-  }
+  Scouts.main()->wait_for_search_finished();
 
-  std::cout << tab << "]\n}" << std::endl;
+  evict_results(full_path(dbName) + "\n", "", CacheSize);
 }
 
 
@@ -431,10 +2888,240 @@ ScoutMove parse_move(const std::string& san, Color c) {
 }
 
 
-void parse_condition(Scout::Data& data, const json& item, int streakId = 0) {
+/// compile_subfens() lays out the sub-fen patterns as a structure of arrays, so
+/// that the masks of the same kind of many patterns can be loaded at once.
 
-  Condition cond = Condition();
-  cond.streakId = streakId;
+SubFenSet compile_subfens(const std::vector<SubFen>& subfens) {
+
+  SubFenSet set;
+  set.size = subfens.size();
+  set.stride = (set.size + SubFenSet::Lanes - 1) / SubFenSet::Lanes * SubFenSet::Lanes;
+  set.masks.resize(SubFenMaskNb * set.stride);
+
+  for (int k = 0; k < SubFenMaskNb; ++k)
+  {
+      Bitboard any = 0;
+
+      for (size_t i = 0; i < set.size; ++i)
+          any |= set.masks[k * set.stride + i] = subfens[i].masks[k];
+
+      // Color masks are always checked, first
+      if (any && k > BLACK)
+          set.used.push_back(k);
+  }
+
+  return set;
+}
+
+
+/// add_material_keys() recursively enumerates all the piece counts within the
+/// given ranges and adds the corresponding material keys.
+
+void add_material_keys(std::vector<Key>& keys, const int lo[], const int hi[], Piece pc, Key key) {
+
+  if (pc > B_QUEEN)
+  {
+      keys.push_back(key);
+      return;
+  }
+
+  if (pc == W_KING) // Skip kings and unused piece codes
+      pc = B_PAWN;
+
+  for (int cnt = 0; cnt <= hi[pc]; ++cnt)
+  {
+      if (cnt >= lo[pc])
+          add_material_keys(keys, lo, hi, Piece(pc + 1), key);
+
+      key ^= Zobrist::psq[pc][cnt];
+  }
+}
+
+
+/// parse_material_range() expands a material range, like { "R": 1, "P": [1, 3] },
+/// into the material keys of all the distributions it covers. A piece letter
+/// sets the count range for both sides, prefixed with 'w' or 'b' only for one
+/// side. Pieces not in the range are absent, kings are always present. Returns
+/// false if the range is empty or too big, and adds no key.
+
+bool parse_material_range(std::vector<Key>& keys, const json& range) {
+
+  const size_t MaxKeys = 1 << 20;
+  const std::string Pieces = " PNBRQ";
+
+  int lo[PIECE_NB] = {}, hi[PIECE_NB] = {};
+  size_t cnt = 1;
+
+  // Ranges for both sides go first, so that the ones for one side override them
+  for (int side = 0; side < 2; ++side)
+      for (auto it = range.begin(); it != range.end(); ++it)
+      {
+          std::string name = it.key();
+          bool both = name.size() == 1;
+          size_t pt = Pieces.find(toupper(name.back()));
+
+          if (   both != (side == 0)
+              || pt == std::string::npos || !pt
+              || (!both && (name.size() != 2 || (name[0] != 'w' && name[0] != 'b'))))
+              continue;
+
+          const json& v = it.value();
+          int l = v.is_array() ? v.front().get<int>() : v.get<int>();
+          int h = v.is_array() ? v.back().get<int>() : v.get<int>();
+          int max = pt == PAWN ? 8 : 10;
+
+          for (Color c = WHITE; c <= BLACK; ++c)
+              if (both || name[0] == (c == WHITE ? 'w' : 'b'))
+              {
+                  Piece pc = make_piece(c, PieceType(pt));
+                  lo[pc] = std::max(l, 0);
+                  hi[pc] = std::min(h, max);
+              }
+      }
+
+  for (Color c = WHITE; c <= BLACK; ++c)
+      for (PieceType pt = PAWN; pt <= QUEEN; ++pt)
+          cnt *= size_t(std::max(hi[make_piece(c, pt)] - lo[make_piece(c, pt)] + 1, 0));
+
+  if (!cnt || cnt > MaxKeys)
+      return false;
+
+  add_material_keys(keys, lo, hi, W_PAWN, Zobrist::psq[W_KING][0] ^ Zobrist::psq[B_KING][0]);
+  return true;
+}
+
+
+/// piece_on() returns the piece required by the sub-fen on the given square, if any
+
+Piece piece_on(const SubFen& f, Square s) {
+
+  if (!((f.masks[WHITE] | f.masks[BLACK]) & s))
+      return NO_PIECE;
+
+  for (PieceType pt = PAWN; pt <= KING; ++pt)
+      if (f.masks[1 + pt] & s)
+          return make_piece(f.masks[WHITE] & s ? WHITE : BLACK, pt);
+
+  return NO_PIECE;
+}
+
+
+/// build_index() recursively builds the decision tree node of the given sub-fen
+/// patterns and returns its index. The node square is the one that minimizes the
+/// expected number of patterns to visit, assuming the pieces on the squares of
+/// the positions are distributed as in the patterns. Patterns are partitioned
+/// among the children, so the tree size is linear in the number of patterns.
+
+int build_index(SubFenIndex& index, const std::vector<SubFen>& subfens,
+                const std::vector<size_t>& ids, int depth) {
+
+  const size_t LeafSize = 32;
+  const int MaxDepth = 64;
+
+  int n = int(index.nodes.size());
+  double bestScore = double(ids.size());
+  Square best = SQ_NONE;
+
+  index.nodes.emplace_back();
+  index.depth = std::max(index.depth, depth);
+
+  if (ids.size() > LeafSize && depth < MaxDepth)
+      for (Square s = SQ_A1; s <= SQ_H8; ++s)
+      {
+          size_t cnt[PIECE_NB] = {};
+
+          for (size_t id : ids)
+              cnt[piece_on(subfens[id], s)]++;
+
+          double score = double(cnt[NO_PIECE]);
+          for (Piece pc = W_PAWN; pc <= B_KING; ++pc)
+              score += double(cnt[pc]) * cnt[pc] / ids.size();
+
+          if (score < bestScore - 1)
+          {
+              bestScore = score;
+              best = s;
+          }
+      }
+
+  index.nodes[n].sq = best;
+  std::fill(index.nodes[n].children, index.nodes[n].children + PIECE_NB, 0);
+
+  if (best == SQ_NONE)
+  {
+      std::vector<SubFen> leaf;
+
+      for (size_t id : ids)
+          leaf.push_back(subfens[id]);
+
+      index.nodes[n].leaf = compile_subfens(leaf);
+      index.leaves++;
+      return n;
+  }
+
+  std::vector<size_t> children[PIECE_NB];
+
+  for (size_t id : ids)
+      children[piece_on(subfens[id], best)].push_back(id);
+
+  for (Piece pc = NO_PIECE; pc < PIECE_NB; ++pc)
+      if (children[pc].size())
+      {
+          int child = build_index(index, subfens, children[pc], depth + 1);
+          index.nodes[n].children[pc] = child;
+      }
+
+  return n;
+}
+
+
+void parse_rules(Condition& cond, const json& item);
+
+/// parse_expr() adds to the expression a node of the given type, with a leaf
+/// for each sub-condition in the list, and returns its index. Identical
+/// sub-conditions share the same leaf.
+
+size_t parse_expr(Expr& e, ExprType type, const json& items, std::map<std::string, size_t>& leaves) {
+
+  json list = items;
+
+  if (!list.is_array())
+  {
+      list = json::array();
+      list.push_back(items);
+  }
+
+  ExprNode node = { type, 0, {} };
+
+  for (const json& item : list)
+  {
+      const std::string key = item.dump();
+
+      if (!leaves.count(key))
+      {
+          Condition cond = Condition();
+          parse_rules(cond, item);
+          cond.rules.push_back(RuleMatchedCondition);
+          cond.matcher = select_matcher(cond.rules);
+          cond.stats.resize(cond.rules.size());
+          cond.profileStats.resize(cond.rules.size());
+
+          leaves[key] = e.leaves.size();
+          e.leaves.push_back(cond);
+      }
+
+      e.nodes.push_back({ ExprLeaf, leaves[key], {} });
+      node.children.push_back(e.nodes.size() - 1);
+  }
+
+  e.nodes.push_back(node);
+  return e.nodes.size() - 1;
+}
+
+
+/// parse_rules() extracts the rules of a condition out of its JSON object
+
+void parse_rules(Condition& cond, const json& item) {
 
   if (item.count("result"))
   {
@@ -466,6 +3153,8 @@ void parse_condition(Scout::Data& data, const json& item, int streakId = 0) {
 
   if (item.count("sub-fen"))
   {
+      std::vector<SubFen> subfens;
+
       for (const auto& fen : item["sub-fen"])
       {
           StateInfo st;
@@ -474,23 +3163,60 @@ void parse_condition(Scout::Data& data, const json& item, int streakId = 0) {
 
           // Setup the pattern to be searched
           SubFen f;
-          f.white = pos.pieces(WHITE);
-          f.black = pos.pieces(BLACK);
+          f.masks[WHITE] = pos.pieces(WHITE);
+          f.masks[BLACK] = pos.pieces(BLACK);
           for (PieceType pt = PAWN; pt <= KING; ++pt)
-              if (pos.pieces(pt))
-                  f.pieces.push_back(std::make_pair(pt, pos.pieces(pt)));
-          cond.subfens.push_back(f);
+              f.masks[1 + pt] = pos.pieces(pt);
+          subfens.push_back(f);
+      }
+      // Big lists are indexed, so that each position is tested only against
+      // the few patterns that could match.
+      if (subfens.size() > SubFenIndexSize)
+      {
+          std::vector<size_t> ids(subfens.size());
+
+          for (size_t i = 0; i < ids.size(); ++i)
+              ids[i] = i;
+
+          uint64_t start = cycles();
+          cond.subfenIndex = SubFenIndex();
+          cond.subfenIndex.size = subfens.size();
+          build_index(cond.subfenIndex, subfens, ids, 0);
+          cond.subfenIndex.buildCycles = cycles() - start;
       }
-      if (cond.subfens.size())
+      else if (subfens.size())
+          cond.subfens = compile_subfens(subfens);
+
+      if (subfens.size())
           cond.rules.push_back(RuleSubFen);
   }
 
-  if (item.count("material"))
+  if (item.count("material") || item.count("material-range"))
   {
+      std::vector<Key> keys;
       StateInfo st;
-      for (const auto& mat : item["material"])
-          cond.matKeys.push_back(Position().set(mat, WHITE, &st).material_key());
-      if (cond.matKeys.size())
+
+      if (item.count("material"))
+          for (const auto& mat : item["material"])
+              keys.push_back(Position().set(mat, WHITE, &st).material_key());
+
+      if (item.count("material-range"))
+      {
+          json ranges = item["material-range"];
+
+          if (!ranges.is_array())
+              ranges = json::array({ ranges });
+
+          for (const json& range : ranges)
+              if (!parse_material_range(keys, range))
+                  std::cerr << "Invalid material range " << range.dump()
+                            << ", it matches nothing" << std::endl;
+      }
+
+      cond.matKeys.build(keys);
+
+      // Without keys the rule matches nothing, as an invalid range should
+      if (keys.size() || item.count("material-range"))
           cond.rules.push_back(RuleMaterial);
   }
 
@@ -575,31 +3301,188 @@ void parse_condition(Scout::Data& data, const json& item, int streakId = 0) {
   if (item.count("pass"))
       cond.rules.push_back(RulePass);
 
+  // Boolean composition of sub-conditions, all the fields must be satisfied
+  if (item.count("any-of") || item.count("all-of") || item.count("not"))
+  {
+      Expr& e = cond.expr;
+      std::map<std::string, size_t> leaves;
+
+      e.nodes.push_back({ ExprAnd, 0, {} });
+
+      if (item.count("any-of"))
+      {
+          size_t n = parse_expr(e, ExprOr, item["any-of"], leaves);
+          e.nodes[0].children.push_back(n);
+      }
+
+      if (item.count("all-of"))
+      {
+          size_t n = parse_expr(e, ExprAnd, item["all-of"], leaves);
+          e.nodes[0].children.push_back(n);
+      }
+
+      // Negation of a list is true if none of the sub-conditions is satisfied
+      if (item.count("not"))
+      {
+          size_t n = parse_expr(e, ExprOr, item["not"], leaves);
+          e.nodes.push_back({ ExprNot, 0, { n } });
+          e.nodes[0].children.push_back(e.nodes.size() - 1);
+      }
+
+      e.values.resize(e.leaves.size());
+      cond.rules.push_back(RuleExpr);
+  }
+}
+
+
+void parse_condition(Query& query, const json& item) {
+
+  Condition cond = Condition();
+
+  if (item.count("within") && item["within"] > 0)
+      cond.window = item["within"];
+
+  if (item.count("optional"))
+      cond.optional = item["optional"];
+
+  parse_rules(cond, item);
+
   if (cond.rules.size())
   {
       cond.rules.push_back(RuleMatchedCondition);
-      data.conditions.push_back(cond);
+      query.conditions.push_back(cond);
+  }
+
+  // Matching a condition at least n times is the same of a sequence of n copies
+  // of it. Each copy is a state of the cursor, so the number is capped.
+  if (cond.rules.size() && item.count("repeat") && item["repeat"] > 1)
+  {
+      int n = std::min(int(item["repeat"]), 64);
+
+      while (--n)
+          query.conditions.push_back(cond);
   }
 }
 
 
-void parse_streak(Scout::Data& data, const json& streak) {
+void parse_streak(Query& query, const json& streak) {
 
-  static int streakId;
+  size_t first = query.conditions.size();
 
-  ++streakId;
   for (const json& item : streak)
-      parse_condition(data, item, streakId);
+      parse_condition(query, item);
+
+  // Each condition of a streak should match in the ply after the previous one
+  for (size_t i = first + 1; i < query.conditions.size(); ++i)
+      query.conditions[i].window = 1;
 }
 
 
-void parse_sequence(Scout::Data& data, const json& sequence) {
+void parse_sequence(Query& query, const json& sequence) {
 
   for (const json& item : sequence)
       if (item.count("streak"))
-          parse_streak(data, item["streak"]);
+          parse_streak(query, item["streak"]);
       else
-          parse_condition(data, item);
+          parse_condition(query, item);
+}
+
+
+/// parse_single() extracts the rules of a single query out of its JSON object
+
+void parse_single(Query& query, const json& j) {
+
+  if (j.count("skip"))
+      query.skip = j["skip"];
+
+  if (j.count("limit"))
+      query.limit = j["limit"];
+
+  if (j.count("resume"))
+  {
+      std::string token = j["resume"];
+      std::istringstream(token) >> std::hex >> query.resume;
+  }
+
+  query.maxPly = -1;
+  if (j.count("max-ply"))
+      query.maxPly = j["max-ply"];
+
+  if (j.count("max-time") && j["max-time"] > 0)
+      query.maxTime = j["max-time"];
+
+  if (j.count("all-plies"))
+      query.allPlies = j["all-plies"];
+
+  if (j.count("profile"))
+      query.profile = j["profile"];
+
+  if (j.count("stream"))
+      query.stream = j["stream"];
+
+  if (j.count("output") && j["output"] == "count")
+      query.output = OutputCount;
+
+  if (j.count("group-by"))
+  {
+      const std::string group = j["group-by"];
+
+      query.groupBy =  group == "result"       ? GroupResult
+                     : group == "material"     ? GroupMaterial
+                     : group == "side-to-move" ? GroupSideToMove
+                     : group == "ply"          ? GroupPly
+                     : group == "next-move"    ? GroupNextMove : GroupNone;
+
+      if (query.groupBy)
+          query.output = OutputCount;
+  }
+
+  query.plyBucket = 10;
+  if (j.count("ply-bucket") && j["ply-bucket"] > 0)
+      query.plyBucket = j["ply-bucket"];
+
+  if (j.count("approximate"))
+  {
+      const json& a = j["approximate"];
+      query.sample = a.count("sample") ? double(a["sample"]) : 0.01;
+
+      // A sample of zero or less is clamped to the smallest one, a single chunk,
+      // rather than silently running a full search.
+      query.sample = std::min(std::max(query.sample, DBL_MIN), 1.0);
+  }
+
+  // Aggregates count all the matches, and an approximate query just a sample of
+  // them: there is no page to return.
+  if (query.output == OutputCount || query.sample > 0)
+      query.skip = query.limit = 0;
+
+  if (j.count("sequence"))
+      parse_sequence(query, j["sequence"]);
+
+  else if (j.count("streak"))
+      parse_streak(query, j["streak"]);
+
+  else
+      parse_condition(query, j);
+
+  // Change the end rule of the last condition
+  if (query.conditions.size())
+      query.conditions.back().rules.back() = RuleMatchedQuery;
+  else
+  {
+      // If query is empty push a default condition with RuleNone
+      Condition cond = Condition();
+      cond.rules.push_back(RuleNone);
+      query.conditions.push_back(cond);
+  }
+
+  // Compile the rules of each condition into its matcher
+  for (Condition& cond : query.conditions)
+  {
+      cond.matcher = select_matcher(cond.rules);
+      cond.stats.resize(cond.rules.size());
+      cond.profileStats.resize(cond.rules.size());
+  }
 }
 
 
@@ -622,6 +3505,7 @@ void parse_query(Scout::Data& data, std::istringstream& is) {
 
      Simplified grammar for our queries
 
+     <batch>     ::= "[" <query> { "," <query> } "]"   // Only with scout-batch
      <query>     ::= <sequence> | <streak> | <condition>
      <sequence>  ::= "{ "sequence": [" <condition> | streak { "," <condition> | streak } "] }"
      <streak>    ::= "{   "streak": [" <condition> { "," <condition> } "] }"
@@ -633,32 +3517,34 @@ void parse_query(Scout::Data& data, std::istringstream& is) {
 
   json j = json::parse(is);
 
-  if (j.count("skip"))
-      data.skip = j["skip"];
-
-  if (j.count("limit"))
-      data.limit = j["limit"];
-
-  if (j.count("sequence"))
-      parse_sequence(data, j["sequence"]);
-
-  else if (j.count("streak"))
-      parse_streak(data, j["streak"]);
-
-  else
-      parse_condition(data, j);
+  data.key = j.dump(); // Canonical, object members are sorted
 
-  // Change the end rule of the last condition
-  if (data.conditions.size())
-      data.conditions.back().rules.back() = RuleMatchedQuery;
+  // A batch is an array of queries, each one with its own results
+  if (data.batch)
+      for (const json& item : j)
+      {
+          data.queries.emplace_back();
+          parse_single(data.queries.back(), item);
+      }
   else
   {
-      // If query is empty push a default condition with RuleNone
-      Condition cond;
-      cond.rules.push_back(RuleNone);
-      data.conditions.push_back(cond);
+      data.queries.emplace_back();
+      parse_single(data.queries.back(), j);
   }
 
+  // If a query of a batch streams its matches, all of them do
+  data.stream = std::any_of(data.queries.begin(), data.queries.end(), [](const Query& q) {
+                                return q.stream; });
+
+  // A valid resume token points just after the beginning of a game
+  for (Query& q : data.queries)
+      if (   q.resume
+          && (   q.resume > data.dbSize
+              || (q.resume > 1 && data.baseAddress[q.resume - 2] != MOVE_NONE)))
+      {
+          std::cerr << "Invalid resume token, ignored" << std::endl;
+          q.resume = 0;
+      }
 }
 
 } // namespace Scout
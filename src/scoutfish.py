@@ -22,6 +22,16 @@ class Scoutfish:
         self.p.sendline('isready')
         self.p.expect(u'readyok')
 
+    def get_output(self):
+        '''Return the output of last command, skipping the progress info
+           lines and the error messages before the result, if any'''
+        lines = self.p.before.splitlines(True)
+        self.p.before = ''
+        lines = [l for l in lines if not l.startswith('info ')]
+        while lines and not lines[0].startswith(('{', '[')):
+            lines.pop(0)
+        return ''.join(lines)
+
     def open(self, pgn):
         '''Open a PGN file and create an index if not exsisting'''
         if not os.path.isfile(pgn):
@@ -54,6 +64,35 @@ class Scoutfish:
         self.p.before = ''
         return result
 
+    def make_opening(self, plies=32):
+        '''Make the ply-major opening block of the DB, used to speed up
+           queries with a max-ply not bigger than plies'''
+        if not self.db:
+            raise NameError("Unknown DB, first open a PGN file")
+        cmd = 'make-opening {} {}'.format(self.db, plies)
+        self.p.sendline(cmd)
+        self.wait_ready()
+        s = '{' + self.p.before.split('{')[1]
+        s = s.replace('\\', r'\\')  # Escape Windows's path delimiter
+        result = json.loads(s)
+        self.p.before = ''
+        return result
+
+    def open_db(self):
+        '''Keep the DB memory-mapped in the engine, to speed up the
+           following queries, until close_db() is called'''
+        if not self.db:
+            raise NameError("Unknown DB, first open a PGN file")
+        self.p.sendline('open ' + self.db)
+        self.wait_ready()
+
+    def close_db(self):
+        '''Release the DB kept mapped by open_db()'''
+        if not self.db:
+            raise NameError("Unknown DB, first open a PGN file")
+        self.p.sendline('close ' + self.db)
+        self.wait_ready()
+
     def setoption(self, name, value):
         '''Set an option value, like threads number'''
         cmd = "setoption name {} value {}".format(name, value)
@@ -68,9 +107,45 @@ class Scoutfish:
         cmd = "scout {} {}".format(self.db, j)
         self.p.sendline(cmd)
         self.wait_ready()
-        result = json.loads(self.p.before)
-        self.p.before = ''
-        return result
+        return json.loads(self.get_output())
+
+    def scout_stream(self, q):
+        '''Run query defined by 'q' dict streaming the matches. Yield a dict
+           for each match as soon as found and, at last, the result dict'''
+        if not self.db:
+            raise NameError("Unknown DB, first open a PGN file")
+        j = json.dumps(dict(q, stream=True))
+        cmd = "scout {} {}".format(self.db, j)
+        self.p.sendline(cmd)
+        while True:
+            line = self.p.readline().strip()
+            if not line.startswith('{'):  # Info lines and error messages
+                continue
+            result = json.loads(line)
+            yield result
+            if 'match count' in result:
+                break
+
+    def scout_batch(self, queries):
+        '''Run a list of queries replaying the DB only once. Result will be a
+           list with one dict for each query'''
+        if not self.db:
+            raise NameError("Unknown DB, first open a PGN file")
+        j = json.dumps(queries)
+        cmd = "scout-batch {} {}".format(self.db, j)
+        self.p.sendline(cmd)
+        self.wait_ready()
+        return json.loads(self.get_output())
+
+    def explain(self, q):
+        '''Return the plan chosen to run query 'q', without running it'''
+        if not self.db:
+            raise NameError("Unknown DB, first open a PGN file")
+        j = json.dumps(q)
+        cmd = "explain {} {}".format(self.db, j)
+        self.p.sendline(cmd)
+        self.wait_ready()
+        return json.loads(self.get_output())
 
     def scout_raw(self, q):
         '''Run query defined by 'q' dict. Result will be full output'''
@@ -80,9 +155,7 @@ class Scoutfish:
         cmd = "scout {} {}".format(self.db, j)
         self.p.sendline(cmd)
         self.wait_ready()
-        result = self.p.before
-        self.p.before = ''
-        return result
+        return self.get_output()
 
     def get_games(self, matches):
         '''Retrieve the PGN games specified in the offset list. Games are
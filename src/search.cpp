@@ -260,7 +260,7 @@ void MainThread::search() {
   DrawValue[ us] = VALUE_DRAW - Value(contempt);
   DrawValue[~us] = VALUE_DRAW + Value(contempt);
 
-  if (rootMoves.empty() && !scout.baseAddress)
+  if (rootMoves.empty())
   {
       rootMoves.push_back(RootMove(MOVE_NONE));
       sync_cout << "info depth 0 score "
@@ -300,10 +300,6 @@ void MainThread::search() {
       if (th != this)
           th->wait_for_search_finished();
 
-  // Scouting, just return
-  if (scout.baseAddress)
-      return Scout::print_results(Limits);
-
   // Check if there are threads with a better score than main thread
   Thread* bestThread = this;
   if (   !this->easyMovePlayed
@@ -339,9 +335,6 @@ void MainThread::search() {
 
 void Thread::search() {
 
-  if (scout.baseAddress)
-      return Scout::search(this);
-
   Stack stack[MAX_PLY+7], *ss = stack+4; // To allow referencing (ss-4) and (ss+2)
   Value bestValue, alpha, beta, delta;
   Move easyMove = MOVE_NONE;
@@ -23,6 +23,7 @@
 
 #include <atomic>
 #include <sstream>
+#include <unordered_map>
 #include <vector>
 
 #include "misc.h"
@@ -41,15 +42,94 @@ enum ResultType {
   ResultNone, ResultMate, ResultStalemate
 };
 
+enum OutputType {
+  OutputMatches, OutputCount
+};
+
+enum GroupType {
+  GroupNone, GroupResult, GroupMaterial, GroupSideToMove, GroupPly, GroupNextMove
+};
+
 enum RuleType {
   RuleNone, RulePass, RuleResult, RuleResultType, RuleSubFen, RuleMaterial,
   RuleImbalance, RuleMove, RuleQuietMove, RuleCapturedPiece, RuleMovedPiece,
-  RuleWhite, RuleBlack, RuleMatchedCondition, RuleMatchedQuery
+  RuleWhite, RuleBlack, RuleExpr, RuleMatchedCondition, RuleMatchedQuery
 };
 
+/// SubFen is a sub-fen pattern as a list of masks, one for each color followed
+/// by one for each piece type. Position matches if it has all the masked pieces.
+
+enum { SubFenMaskNb = 2 + KING };
+
 struct SubFen {
-  Bitboard white, black;
-  std::vector<std::pair<PieceType, Bitboard>> pieces;
+  Bitboard masks[SubFenMaskNb];
+};
+
+/// SubFenSet stores the sub-fen patterns of a condition as a structure of
+/// arrays: the masks of the same kind are contiguous, padded to a multiple of
+/// Lanes, so that many patterns can be tested at once with SIMD instructions.
+/// Only the kinds of masks used by at least one pattern are checked.
+
+struct SubFenSet {
+  static const size_t Lanes = 8;
+
+  size_t size, stride;
+  std::vector<int> used;
+  std::vector<Bitboard> masks; // SubFenMaskNb arrays of stride masks
+};
+
+/// SubFenIndex is a decision tree used instead of a flat SubFenSet when the
+/// sub-fen list is big. Each inner node splits its patterns according to the
+/// piece they require on the node square, the ones that do not care about
+/// that square go to children[NO_PIECE]. So a position visits at most two
+/// children per node, and only the leaves that could match are scanned.
+
+struct SubFenNode {
+  Square sq;              // SQ_NONE for leaves
+  int children[PIECE_NB]; // 0 if no child, root can not be a child
+  SubFenSet leaf;
+};
+
+struct SubFenIndex {
+  size_t size, leaves;
+  int depth;
+  uint64_t buildCycles;
+  std::vector<SubFenNode> nodes;
+};
+
+/// MaterialSet is an open-addressed hash set of material keys with linear
+/// probing, so that lookup cost does not depend on the number of keys. Zero
+/// marks an empty slot: material keys include the kings, so are never zero.
+
+struct MaterialSet {
+
+  void build(const std::vector<Key>& keys) {
+    size_t sz = 16;
+    while (sz < 2 * keys.size()) // Keep load factor below 1/2
+        sz *= 2;
+
+    size = 0;
+    mask = sz - 1;
+    table.assign(sz, 0);
+    for (Key k : keys)
+    {
+        size_t i = k & mask;
+        while (table[i] && table[i] != k)
+            i = (i + 1) & mask;
+        size += !table[i];
+        table[i] = k;
+    }
+  }
+
+  bool contains(Key k) const {
+    for (size_t i = k & mask; table[i]; i = (i + 1) & mask)
+        if (table[i] == k)
+            return true;
+    return false;
+  }
+
+  size_t size, mask;
+  std::vector<Key> table;
 };
 
 struct ScoutMove {
@@ -65,32 +145,113 @@ struct Imbalance {
   int pawnCount;
 };
 
+struct RuleStats {
+  uint64_t calls, passes, cycles;
+};
+
+struct Board;
+struct Condition;
+
+typedef RuleType (*Matcher)(const Condition*, const Board&, Move, GameResult);
+
+/// Expr is a boolean expression of sub-conditions, out of the "any-of", "all-of"
+/// and "not" fields of a condition. Nodes are in a flat array, root is the first
+/// one. Identical sub-conditions are stored once and evaluated at most once for
+/// each position, whatever the number of leaves they appear in.
+
+enum ExprType {
+  ExprAnd, ExprOr, ExprNot, ExprLeaf
+};
+
+struct ExprNode {
+  ExprType type;
+  size_t leaf; // Index of the sub-condition of a leaf node
+  std::vector<size_t> children;
+};
+
+struct Expr {
+  std::vector<ExprNode> nodes;
+  std::vector<Condition> leaves;
+  mutable std::vector<int8_t> values; // Leaf results, -1 if not evaluated yet
+};
+
 struct Condition {
+  Matcher matcher;
   Bitboard moveSquares;
-  int streakId;
+  int window;    // Plies after the previous condition to match it, 0 for any
+  bool optional; // Can be skipped
   ResultType resultType;
   uint64_t movedFlags, capturedFlags;
   std::vector<RuleType> rules;
-  std::vector<SubFen> subfens;
+  mutable std::vector<RuleStats> stats;        // Of all the rules, updated by sampling
+  mutable std::vector<RuleStats> profileStats; // Of the rules up to the first failing one
+  SubFenSet subfens;
+  SubFenIndex subfenIndex;
   std::vector<GameResult> results;
   std::vector<ScoutMove> moves;
-  std::vector<Key> matKeys;
+  MaterialSet matKeys;
   std::vector<Imbalance> imbalances;
+  Expr expr;
 };
 
 struct MatchingGame {
-  uint64_t gameOfs;
-  std::vector<size_t> plies;
+  uint64_t gameIdx, gameOfs; // Index in the DB, offset in the PGN file
+  std::vector<uint16_t> plies; // Compact, with "all-plies" they can be many
+};
+
+struct Query {
+  size_t skip, limit;
+  uint64_t resume; // Skip the games before this index in the DB, 0 for none
+  int maxPly;
+  TimePoint maxTime; // Milliseconds to search, 0 for no limit
+  bool allPlies; // Report all the matching plies of a game, not just the first
+  bool profile;  // Report rule statistics and the work done by each thread
+  bool stream;   // Print each match as a NDJSON line as soon as found
+  OutputType output;
+  GroupType groupBy;
+  size_t plyBucket; // Plies of each group, when grouping by ply
+  double sample;    // Fraction of the chunks to search if approximate, else 0
+  std::vector<Condition> conditions;
+  std::vector<MatchingGame> matches;
+  size_t count;                                // Matches in count mode
+  std::unordered_map<uint64_t, size_t> groups; // Group key, matches
+  std::vector<std::pair<size_t, size_t>> chunks; // Chunk index, end of its matches
+  std::vector<std::pair<size_t, size_t>> samples; // Sampled chunk, its matches
+  size_t chunk, chunkBegin; // Chunk being searched, index of its first match
+  bool full;                // No more matches needed in this chunk
+  bool sampled;             // Chunk is in the sample, always if not approximate
+};
+
+/// Plan is a way to search the DB, with its estimated games and plies to replay
+/// and its cost, as computed by the query planner.
+
+enum PlanType {
+  PlanScan, PlanOpening, PLAN_NB
+};
+
+struct Plan {
+  bool valid;
+  uint64_t games, plies, cost;
 };
 
 struct Data {
   Move* baseAddress;
+  Move* plyBase;
   size_t dbMapping, dbSize;
-  size_t skip, limit, movesCnt;
-  std::vector<Condition> conditions;
-  std::vector<MatchingGame> matches;
+  size_t plyMapping, plyGames, plyCount;
+  size_t movesCnt, gamesCnt, matchesCnt; // Updated at the end of each chunk, under lock
+  size_t pliesCnt, skippedCnt; // Positions checked, games not replayed to the end
+  TimePoint endTime;
+  bool batch;
+  bool stream;     // Some query streams its matches
+  bool persistent; // Mappings owned by an open DB, not to be unmapped
+  std::string key;  // Of the result in the cache, empty if not to be cached
+  PlanType plan;
+  Plan plans[PLAN_NB];
+  std::vector<Query> queries;
 };
 
+
 }
 
 namespace Search {
@@ -142,7 +303,6 @@ struct LimitsType {
   LimitsType() { // Init explicitly due to broken value-initialization of non POD in MSVC
     nodes = time[WHITE] = time[BLACK] = inc[WHITE] = inc[BLACK] =
     npmsec = movestogo = depth = movetime = mate = infinite = ponder = 0;
-    scout = Scout::Data();
   }
 
   bool use_time_management() const {
@@ -153,7 +313,6 @@ struct LimitsType {
   int time[COLOR_NB], inc[COLOR_NB], npmsec, movestogo, depth, movetime, mate, infinite, ponder;
   int64_t nodes;
   TimePoint startTime;
-  Scout::Data scout;
 };
 
 
@@ -174,13 +333,33 @@ template<bool Root = true> uint64_t perft(Position& pos, Depth depth);
 } // namespace Search
 
 
-class Thread;
+class ScoutThread;
 
 namespace Scout {
 
+/// next_game() returns the beginning of the game following the one starting at
+/// 'game' in a DB, skipping the offset and the result of the game, that could
+/// alias a game separator.
+
+inline Move* next_game(Move* game) {
+
+  game += 5;
+  while (*game++ != MOVE_NONE) {}
+  return game;
+}
+
+std::string opening_name(std::string);
+void open_db(const std::string&);
+bool close_db(const std::string&);
+void map_db(Scout::Data&, const std::string&);
 void parse_query(Scout::Data&, std::istringstream&);
-void search(Thread*);
-void print_results(const Search::LimitsType&);
+void plan_query(Scout::Data&, const std::string&);
+bool find_result(Scout::Data&, const std::string&, const Position&);
+void clear_results(const std::string&);
+void explain(const Scout::Data&);
+void init_search(const Scout::Data&, const Position&);
+void search(ScoutThread*);
+void print_results();
 
 } // namespace Scout
 
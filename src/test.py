@@ -1,8 +1,11 @@
 #!/usr/bin/env python
 
+import atexit
 import json
 import os
+import shutil
 import sys
+import tempfile
 import unittest
 
 from scoutfish import Scoutfish
@@ -35,6 +38,15 @@ QUERIES = [
     {'q': {'material': ['KRBPPPKRPPP', 'KRPPPKRPPP']},
         'count': 4, 'matches': [{'ofs': 666, 'ply': [77]}, {'ofs': 164246, 'ply': [83]}]},
 
+    {'q': {'material-range': {'R': 1, 'P': [2, 3]}},
+        'count': 4, 'matches': [{'ofs': 666, 'ply': [80]}, {'ofs': 164246, 'ply': [83]}]},
+
+    {'q': {'material-range': {'Q': [3, 1]}},  # Invalid, matches nothing
+        'count': 0, 'matches': []},
+
+    {'q': {'sequence': [{'white-move': 'e4'}, {'material-range': {'Q': [3, 1]}}]},
+        'count': 0, 'matches': []},
+
     {'q': {'white-move': 'Nb7'},
         'count': 6, 'matches': [{'ofs': 141745, 'ply': [34]}, {'ofs': 538533, 'ply': [36]}]},
 
@@ -50,6 +62,33 @@ QUERIES = [
     {'q': {'skip': 200, 'limit': 100, 'black-move': 'O-O'},
         'count': 100, 'matches': [{'ofs': 485616, 'ply': [15]}, {'ofs': 487518, 'ply': [11]}]},
 
+    {'q': {'sequence': [{'white-move': 'O-O'}, {'black-move': 'O-O', 'within': 4}]},
+        'count': 75, 'matches': [{'ofs': 19722, 'ply': [8, 9]}, {'ofs': 21321, 'ply': [8, 9]}]},
+
+    {'q': {'sequence': [{'white-move': 'e4'}, {'white-move': 'd4', 'optional': True}, {'black-move': 'c5', 'within': 2}]},
+        'count': 78, 'matches': [{'ofs': 16551, 'ply': [0, 1]}, {'ofs': 25716, 'ply': [0, 2, 3]}]},
+
+    {'q': {'sequence': [{'moved': 'N'}, {'white-move': 'Qh5', 'optional': True}, {'captured': 'Q', 'within': 1}]},
+        'count': 25, 'matches': [{'ofs': 30634, 'ply': [37, 38]}, {'ofs': 64548, 'ply': [35, 36]}]},
+
+    {'q': {'sequence': [{'white-move': 'e4'}, {'white-move': 'Qh5', 'optional': True}]},
+        'count': 390, 'matches': [{'ofs': 0, 'ply': [10]}, {'ofs': 666, 'ply': [0]}]},
+
+    {'q': {'sequence': [{'black-move': 'c5', 'optional': True}]},
+        'count': 501, 'matches': [{'ofs': 0, 'ply': []}, {'ofs': 666, 'ply': []}]},
+
+    {'q': {'captured': 'Q', 'repeat': 2},
+        'count': 123, 'matches': [{'ofs': 0, 'ply': [53, 54]}, {'ofs': 666, 'ply': [44, 45]}]},
+
+    {'q': {'any-of': [{'white-move': 'O-O-O'}, {'black-move': 'O-O-O'}]},
+        'count': 67, 'matches': [{'ofs': 10226, 'ply': [35]}, {'ofs': 25716, 'ply': [22]}]},
+
+    {'q': {'imbalance': 'vP', 'not': [{'material': 'KRPKR'}, {'stm': 'black'}]},
+        'count': 365, 'matches': [{'ofs': 0, 'ply': [8]}, {'ofs': 666, 'ply': [54]}]},
+
+    {'q': {'all-plies': True, 'sub-fen': '8/8/8/3Q4/8/8/8/8'},
+        'count': 21, 'matches': [{'ofs': 3313, 'ply': [37, 38, 39, 40, 41]}, {'ofs': 90547, 'ply': [15, 16]}]},
+
     {'q': {'black-move': 'O-O-O'},
         'count': 28, 'matches': [{'ofs': 10226, 'ply': [35]}, {'ofs': 64548, 'ply': [31]}]},
 
@@ -109,6 +148,12 @@ QUERIES = [
 
     {'q': {'streak': [{'moved': 'P', 'captured': 'Q'}, {'captured': ''}]},
         'count': 24, 'matches': [{'ofs': 19722, 'ply': [34, 35]}, {'ofs': 21321, 'ply': [34, 35]}]},
+
+    {'q': {'sub-fen': 'rnbqkbnr/pp1ppppp/8/2p5/4P3/8/PPPP1PPP/RNBQKBNR', 'max-ply': 10},
+        'count': 66, 'matches': [{'ofs': 16551, 'ply': [2]}, {'ofs': 32718, 'ply': [2]}]},
+
+    {'q': {'black-move': 'O-O-O', 'max-ply': 40},
+        'count': 27, 'matches': [{'ofs': 10226, 'ply': [35]}, {'ofs': 64548, 'ply': [31]}]},
 ]
 
 
@@ -116,9 +161,22 @@ QUERIES = [
 sys.stdout.write('Making index...')
 sys.stdout.flush()
 p = Scoutfish(SCOUTFISH)
-p.setoption('threads', 1)
+p.setoption('ScoutThreads', 1)
 p.open('../pgn/famous_games.pgn')
 p.make()  # Force rebuilding of DB index
+p.make_opening(32)
+
+# A DB of many chunks, out of copies of the test games
+tmpdir = tempfile.mkdtemp()
+atexit.register(shutil.rmtree, tmpdir, True)
+big_pgn = os.path.join(tmpdir, 'famous_games_x16.pgn')
+with open(big_pgn, 'wb') as f:
+    data = open('../pgn/famous_games.pgn', 'rb').read()
+    for i in range(16):
+        f.write(data)
+big = Scoutfish(SCOUTFISH)
+big.setoption('ScoutThreads', 1)
+big.open(big_pgn)
 print('done')
 
 
@@ -126,7 +184,228 @@ class TestSuite(unittest.TestCase):
     ''' Each single test will be appended here as a new method
         with setattr(). The methods will then be loaded and
         run by unittest. '''
-    pass
+
+    def test_batch(self):
+        ''' Run all the queries in a single batch, results should
+            be the same of the single queries. '''
+        results = p.scout_batch([e['q'] for e in QUERIES])
+
+        self.assertEqual(len(QUERIES), len(results))
+
+        for expected, result in zip(QUERIES, results):
+            self.assertEqual(expected['count'], result['match count'])
+
+            for idx, match in enumerate(expected['matches']):
+                self.assertEqual(match['ofs'], result['matches'][idx]['ofs'])
+                self.assertEqual(match['ply'], result['matches'][idx]['ply'])
+
+    def test_resume(self):
+        ''' Paginate with the resume token, pages should be the
+            same of the ones got with skip. '''
+        first = p.scout({'limit': 100, 'black-move': 'O-O'})
+        token = first['resume token']
+        result = p.scout({'resume': token, 'limit': 100, 'black-move': 'O-O'})
+        expected = p.scout({'skip': 100, 'limit': 100, 'black-move': 'O-O'})
+
+        self.assertEqual(expected['matches'], result['matches'])
+        self.assertEqual(expected['resume token'], result['resume token'])
+
+
+    def test_group_by(self):
+        ''' Aggregates should count the same matches of the
+            plain query, split in groups. '''
+        result = p.scout({'group-by': 'result', 'black-move': 'O-O'})
+
+        self.assertEqual(354, result['match count'])
+        self.assertNotIn('matches', result)
+        self.assertEqual([{'key': '1-0', 'count': 213}, {'key': '0-1', 'count': 128},
+                          {'key': '1/2-1/2', 'count': 12}, {'key': '*', 'count': 1}],
+                         result['groups'])
+
+
+    def test_approximate(self):
+        ''' Test DB fits in a single chunk, that is always sampled,
+            so the estimate should be exact. '''
+        result = p.scout({'approximate': {'sample': 0.01}, 'black-move': 'O-O'})
+
+        self.assertEqual(354, result['match count'])
+        self.assertEqual({'estimate': 354, 'low': 354, 'high': 354, 'sampled': 1},
+                         result['approximate'])
+
+    def test_approximate_chunks(self):
+        ''' On a DB of many chunks just a part of them is sampled,
+            the estimate should be close to the matches in the DB. '''
+        result = big.scout({'approximate': {'sample': 0.3}, 'black-move': 'O-O'})
+        estimate = result['approximate']
+
+        self.assertLess(result['match count'], 16 * 354)
+        self.assertLess(estimate['sampled'], 0.5)
+        self.assertLessEqual(estimate['low'], estimate['estimate'])
+        self.assertGreaterEqual(estimate['high'], estimate['estimate'])
+        self.assertAlmostEqual(16 * 354, estimate['estimate'], delta=16 * 35)
+
+        # A zero sample searches just one chunk
+        result = big.scout({'approximate': {'sample': 0}, 'black-move': 'O-O'})
+        self.assertLess(result['approximate']['sampled'], estimate['sampled'])
+        self.assertAlmostEqual(16 * 354, result['approximate']['estimate'], delta=16 * 35)
+
+    def test_max_time(self):
+        ''' A query completed within its time budget should be
+            the same of the unlimited one. '''
+        result = p.scout({'max-time': 60000, 'limit': 100, 'black-move': 'O-O'})
+        expected = p.scout({'limit': 100, 'black-move': 'O-O'})
+
+        self.assertNotIn('complete', result)
+        self.assertEqual(expected['matches'], result['matches'])
+
+    def test_max_time_stop(self):
+        ''' A query out of time should return the matches before the first
+            game not searched, and resuming from there the rest of them. '''
+        expected = big.scout({'white-move': 'Qh8'})
+        result = big.scout({'max-time': 1, 'white-move': 'Qh8'})
+        self.assertFalse(result['complete'])
+
+        rest = big.scout({'resume': result['resume token'], 'white-move': 'Qh8'})
+        self.assertEqual(expected['matches'], result['matches'] + rest['matches'])
+
+        result = big.scout({'max-time': 1, 'output': 'count', 'white-move': 'Qh8'})
+        self.assertFalse(result['complete'])
+
+        rest = big.scout({'resume': result['resume token'], 'output': 'count', 'white-move': 'Qh8'})
+        self.assertEqual(expected['match count'], result['match count'] + rest['match count'])
+
+    def test_max_time_progress(self):
+        ''' Resuming with a short time budget should always make progress,
+            until the matches of the whole DB are collected. '''
+        expected = big.scout({'white-move': 'Qh8'})
+        matches, token = [], None
+
+        while True:
+            q = {'max-time': 1, 'white-move': 'Qh8'}
+            if token:
+                q['resume'] = token
+            result = big.scout(q)
+            matches += result['matches']
+            if result.get('complete', True):
+                break
+            self.assertNotEqual(token, result['resume token'])
+            self.assertTrue(not token or int(result['resume token'], 16) > int(token, 16))
+            token = result['resume token']
+
+        self.assertEqual(expected['matches'], matches)
+
+    def test_stop(self):
+        ''' UCI stop should interrupt the engine search only,
+            a running scout is interrupted by stop-scout. '''
+        expected = big.scout({'white-move': 'Qh8'})
+        big.p.sendline('scout {} {}'.format(big.db, json.dumps({'white-move': 'Qh8'})))
+        big.p.sendline('stop')
+        big.wait_ready()
+        result = json.loads(big.get_output())
+
+        self.assertNotIn('complete', result)
+        self.assertEqual(expected['matches'], result['matches'])
+
+        big.p.sendline('scout {} {}'.format(big.db, json.dumps({'white-move': 'Qh8'})))
+        big.p.sendline('stop-scout')
+        big.wait_ready()
+        result = json.loads(big.get_output())
+        self.assertFalse(result['complete'])
+
+        rest = big.scout({'resume': result['resume token'], 'white-move': 'Qh8'})
+        self.assertEqual(expected['matches'], result['matches'] + rest['matches'])
+
+    def test_progress(self):
+        ''' Progress info lines should not change the result. '''
+        expected = p.scout({'black-move': 'O-O'})
+        p.setoption('Progress Interval', 1)
+        result = p.scout({'black-move': 'O-O'})
+        p.setoption('Progress Interval', 0)
+
+        self.assertEqual(expected['matches'], result['matches'])
+
+    def test_profile(self):
+        ''' Each game stops being replayed after its match, so the
+            rule passes should be the matches. '''
+        result = p.scout({'profile': True, 'black-move': 'O-O'})
+        profile = result['profile']
+        rule = profile['conditions'][0]['rules'][0]
+
+        self.assertEqual('move', rule['rule'])
+        self.assertEqual(354, rule['passes'])
+        self.assertEqual(354, sum(t['skipped games'] for t in profile['threads']))
+
+    def test_scout_threads(self):
+        ''' Results should not depend on the number of scout threads. '''
+        expected = p.scout({'skip': 20, 'limit': 100, 'black-move': 'O-O'})
+        p.setoption('ScoutThreads', 3)
+        result = p.scout({'skip': 20, 'limit': 100, 'black-move': 'O-O'})
+        p.setoption('ScoutThreads', 1)
+
+        self.assertEqual(expected['matches'], result['matches'])
+        self.assertEqual(3, len(result['idle time (ms)']))
+
+    def test_explain(self):
+        ''' Opening queries should be planned on the opening block,
+            the other ones on a full scan. '''
+        result = p.explain({'sub-fen': '8/8/8/8/4P3/8/8/8', 'max-ply': 10})
+        self.assertEqual('opening block', result['plan'])
+        self.assertEqual('full scan', result['alternatives'][0]['plan'])
+
+        result = p.explain({'black-move': 'O-O'})
+        self.assertEqual('full scan', result['plan'])
+        self.assertEqual([], result['alternatives'])
+
+    def test_open_db(self):
+        ''' Queries on an open DB should return the same results, also
+            after the DB and its opening block are rebuilt. '''
+        expected = p.scout({'sub-fen': '8/8/8/8/4P3/8/8/8', 'max-ply': 10})
+        p.open_db()
+        result = p.scout({'sub-fen': '8/8/8/8/4P3/8/8/8', 'max-ply': 10})
+        self.assertEqual(expected['matches'], result['matches'])
+
+        p.make_opening(32)
+        result = p.scout({'sub-fen': '8/8/8/8/4P3/8/8/8', 'max-ply': 10})
+        p.close_db()
+        self.assertEqual(expected['matches'], result['matches'])
+
+    def test_open_db_alias(self):
+        ''' An open DB should be found by any name of its file, so
+            that it is closed while rebuilt and then open again. '''
+        expected = p.scout({'black-move': 'O-O'})
+        p.p.sendline('open ../src/' + p.db)
+        p.wait_ready()
+        p.make()
+        result = p.scout({'black-move': 'O-O'})
+        p.close_db()
+
+        self.assertNotIn('DB not open', p.p.before)
+        self.assertEqual(expected['matches'], result['matches'])
+
+    def test_stream(self):
+        ''' Streamed matches should be the same, in the same order. '''
+        expected = p.scout({'skip': 20, 'limit': 100, 'black-move': 'O-O'})
+        result = list(p.scout_stream({'skip': 20, 'limit': 100, 'black-move': 'O-O'}))
+        self.assertEqual(expected['matches'], result[:-1])
+        self.assertEqual(expected['match count'], result[-1]['match count'])
+        self.assertEqual(expected['resume token'], result[-1]['resume token'])
+
+    def test_result_cache(self):
+        ''' A repeated query should be answered out of the cache, until
+            the DB is rebuilt. '''
+        p.setoption('Result Cache', 16)
+        expected = p.scout({'limit': 100, 'black-move': 'O-O'})
+        result = p.scout({'black-move': 'O-O', 'limit': 100})
+        self.assertTrue(result['cached'])
+        self.assertEqual(expected['matches'], result['matches'])
+        self.assertEqual(expected['resume token'], result['resume token'])
+
+        p.make_opening(32)
+        result = p.scout({'limit': 100, 'black-move': 'O-O'})
+        p.setoption('Result Cache', 0)
+        self.assertNotIn('cached', result)
+        self.assertEqual(expected['matches'], result['matches'])
+
 
 
 def create_test(expected):
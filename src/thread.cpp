@@ -28,6 +28,7 @@
 #include "syzygy/tbprobe.h"
 
 ThreadPool Threads; // Global object
+ScoutPool Scouts;   // Global object
 
 /// Thread constructor launches the thread and then waits until it goes to sleep
 /// in idle_loop().
@@ -190,14 +191,14 @@ void ThreadPool::start_thinking(Position& pos, StateListPtr& states,
   main()->wait_for_search_finished();
 
   Search::Signals.stopOnPonderhit = Search::Signals.stop = false;
+
   Search::Limits = limits;
   Search::RootMoves rootMoves;
 
-  if (!limits.scout.baseAddress)
-      for (const auto& m : MoveList<LEGAL>(pos))
-          if (   limits.searchmoves.empty()
-                 || std::count(limits.searchmoves.begin(), limits.searchmoves.end(), m))
-              rootMoves.push_back(Search::RootMove(m));
+  for (const auto& m : MoveList<LEGAL>(pos))
+      if (   limits.searchmoves.empty()
+          || std::count(limits.searchmoves.begin(), limits.searchmoves.end(), m))
+          rootMoves.push_back(Search::RootMove(m));
 
   if (!rootMoves.empty())
       Tablebases::filter_root_moves(pos, rootMoves);
@@ -218,10 +219,160 @@ void ThreadPool::start_thinking(Position& pos, StateListPtr& states,
       th->rootDepth = DEPTH_ZERO;
       th->rootMoves = rootMoves;
       th->rootPos.set(pos.fen(), pos.is_chess960(), &setupStates->back(), th);
-      th->scout = limits.scout;
   }
 
   setupStates->back() = tmp; // Restore st->previous, cleared by Position::set()
 
   main()->start_searching();
 }
+
+
+/// ScoutThread constructor launches the worker and then waits until it goes to
+/// sleep in idle_loop().
+
+ScoutThread::ScoutThread() {
+
+  exit = false;
+  idx = Scouts.size(); // Start from 0
+  scout = Scout::Data();
+
+  std::unique_lock<Mutex> lk(mutex);
+  searching = true;
+  nativeThread = std::thread(&ScoutThread::idle_loop, this);
+  sleepCondition.wait(lk, [&]{ return !searching; });
+}
+
+
+/// ScoutThread destructor waits for worker termination before returning
+
+ScoutThread::~ScoutThread() {
+
+  mutex.lock();
+  exit = true;
+  sleepCondition.notify_one();
+  mutex.unlock();
+  nativeThread.join();
+}
+
+
+/// ScoutThread::wait_for_search_finished() waits on sleep condition until not
+/// searching.
+
+void ScoutThread::wait_for_search_finished() {
+
+  std::unique_lock<Mutex> lk(mutex);
+  sleepCondition.wait(lk, [&]{ return !searching; });
+}
+
+
+/// ScoutThread::start_searching() wakes up the worker that will start to search
+
+void ScoutThread::start_searching() {
+
+  std::unique_lock<Mutex> lk(mutex);
+  searching = true;
+  sleepCondition.notify_one();
+}
+
+
+/// ScoutThread::idle_loop() is where the worker is parked when it has no work
+
+void ScoutThread::idle_loop() {
+
+  while (!exit)
+  {
+      std::unique_lock<Mutex> lk(mutex);
+
+      searching = false;
+
+      while (!searching && !exit)
+      {
+          sleepCondition.notify_one(); // Wake up any waiting thread
+          sleepCondition.wait(lk);
+      }
+
+      lk.unlock();
+
+      if (!exit)
+          search();
+  }
+}
+
+
+/// ScoutThread::search() searches the DB. The main worker starts the others
+/// and, when all of them are done, prints the results.
+
+void ScoutThread::search() {
+
+  if (this == Scouts.main())
+      for (ScoutThread* th : Scouts)
+          if (th != this)
+              th->start_searching();
+
+  Scout::search(this);
+
+  if (this != Scouts.main())
+      return;
+
+  for (ScoutThread* th : Scouts)
+      if (th != this)
+          th->wait_for_search_finished();
+
+  Scout::print_results();
+}
+
+
+/// ScoutPool::init() creates and launches the requested workers, that will go
+/// immediately to sleep.
+
+void ScoutPool::init() {
+
+  read_uci_options();
+}
+
+
+/// ScoutPool::exit() terminates the workers before the program exits
+
+void ScoutPool::exit() {
+
+  while (size())
+      delete back(), pop_back();
+}
+
+
+/// ScoutPool::read_uci_options() creates/destroys workers to match requested
+/// number. A running search is completed first.
+
+void ScoutPool::read_uci_options() {
+
+  size_t requested = Options["ScoutThreads"];
+
+  assert(requested > 0);
+
+  if (size())
+      main()->wait_for_search_finished();
+
+  while (size() < requested)
+      push_back(new ScoutThread);
+
+  while (size() > requested)
+      delete back(), pop_back();
+}
+
+
+/// ScoutPool::start_scouting() wakes up the main worker, that starts a new
+/// search of the DB from the given position, then returns immediately.
+
+void ScoutPool::start_scouting(const Position& pos, const Scout::Data& data) {
+
+  main()->wait_for_search_finished();
+
+  stop = false;
+
+  Scout::init_search(data, pos);
+
+  for (ScoutThread* th : *this)
+      th->scout = data;
+
+  main()->start_searching();
+}
@@ -73,7 +73,6 @@ public:
   MoveStats counterMoves;
   FromToStats fromTo;
   CounterMoveHistoryStats counterMoveHistory;
-  Scout::Data scout;
 };
 
 
@@ -109,4 +108,47 @@ private:
 
 extern ThreadPool Threads;
 
+
+/// ScoutThread is a worker used only to search the DBs. Unlike Thread it has no
+/// search tables, so it is cheap to create and does not depend on the engine
+/// threads: scouting can run even while the engine is searching.
+
+class ScoutThread {
+
+  std::thread nativeThread;
+  Mutex mutex;
+  ConditionVariable sleepCondition;
+  bool exit, searching;
+
+public:
+  ScoutThread();
+  ~ScoutThread();
+  void search();
+  void idle_loop();
+  void start_searching();
+  void wait_for_search_finished();
+
+  size_t idx;
+  Scout::Data scout;
+};
+
+
+/// ScoutPool struct handles the scout workers, their number is set by the
+/// ScoutThreads UCI option. The main worker starts the others, then prints the
+/// results when all of them are done.
+
+struct ScoutPool : public std::vector<ScoutThread*> {
+
+  void init();
+  void exit();
+
+  ScoutThread* main() { return at(0); }
+  void start_scouting(const Position&, const Scout::Data&);
+  void read_uci_options();
+
+  std::atomic_bool stop;
+};
+
+extern ScoutPool Scouts;
+
 #endif // #ifndef THREAD_H_INCLUDED
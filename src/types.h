@@ -37,6 +37,12 @@
 ///
 /// -DUSE_PEXT    | Add runtime support for use of pext asm-instruction. Works
 ///               | only in 64-bit mode and requires hardware with pext support.
+///
+/// -DUSE_AVX2    | Use AVX2 instructions to test many sub-fen patterns at once.
+///               | Requires hardware with AVX2 support.
+///
+/// -DUSE_AVX512  | Use AVX-512 instructions to test many sub-fen patterns at
+///               | once. Requires hardware with AVX-512F support.
 
 #include <cassert>
 #include <cctype>
@@ -72,8 +78,11 @@
 #  include <xmmintrin.h> // Intel and Microsoft header for _mm_prefetch()
 #endif
 
+#if defined(USE_PEXT) || defined(USE_AVX2) || defined(USE_AVX512)
+#  include <immintrin.h> // Header for _pext_u64() and SIMD intrinsics
+#endif
+
 #if defined(USE_PEXT)
-#  include <immintrin.h> // Header for _pext_u64() intrinsic
 #  define pext(b, m) _pext_u64(b, m)
 #else
 #  define pext(b, m) (0)
@@ -38,6 +38,8 @@ extern void benchmark(const Position& pos, istream& is);
 
 namespace Parser {
   void make_db(istringstream& is);
+  void make_opening(istringstream& is);
+  void optimize_db(istringstream& is);
 }
 
 namespace {
@@ -141,16 +143,15 @@ namespace {
     Threads.start_thinking(pos, States, limits);
   }
 
-  // scout() is called when engine receives the "scout" command. The function
-  // memory-maps the Db file, sets teh correct search limits and then starts
-  // the search.
+  // scout() is called when engine receives the "scout" or "scout-batch"
+  // command. The function memory-maps the Db file, unless already open, parses
+  // the query and then, if the result is not cached, starts the search on the
+  // scout threads. With "explain" the query, or the batch, is just planned and
+  // the plan is printed.
 
-  void scout(Position& pos, istringstream& is) {
+  void scout(Position& pos, istringstream& is, bool batch = false, bool explain = false) {
 
-    Search::LimitsType limits;
-    Scout::Data& d = limits.scout;
-    uint64_t mapping, size;
-    void* baseAddress;
+    Scout::Data d = Scout::Data();
     string dbName;
 
     is >> dbName;
@@ -161,17 +162,43 @@ namespace {
         exit(0);
     }
 
-    mem_map(dbName.c_str(), &baseAddress, &mapping, &size);
-
-    d.baseAddress = (Move*)baseAddress;
-    d.dbMapping = mapping;
-    d.dbSize = size / sizeof(Move);
+    Scout::map_db(d, dbName);
+    d.batch = batch || (explain && (is >> ws).peek() == '[');
 
     Scout::parse_query(d, is);
 
-    limits.startTime = now();
+    if (!explain && Scout::find_result(d, dbName, pos))
+        return;
 
-    Threads.start_thinking(pos, States, limits);
+    Scout::plan_query(d, dbName);
+
+    if (explain)
+    {
+        Scout::explain(d);
+        return;
+    }
+
+    Scouts.start_scouting(pos, d);
+  }
+
+  // open_db() is called when engine receives the "open" or "close" command: the Db
+  // file is kept memory-mapped until closed, so that the following scouts on
+  // it do not map it again.
+
+  void open_db(istringstream& is, bool close = false) {
+
+    string dbName;
+
+    is >> dbName;
+
+    if (dbName.empty())
+        cerr << "Missing DB file name..." << endl;
+
+    else if (!close)
+        Scout::open_db(dbName);
+
+    else if (!Scout::close_db(dbName))
+        cerr << "DB not open: " << dbName << endl;
   }
 
 } // namespace
@@ -211,12 +238,22 @@ void UCI::loop(int argc, char* argv[]) {
           ||  token == "stop"
           || (token == "ponderhit" && Search::Signals.stopOnPonderhit))
       {
+          // A running scout is not interrupted by 'quit' (e.g. at the end of
+          // piped commands) but completed first.
+          if (token == "quit")
+              Scouts.main()->wait_for_search_finished();
+
           Search::Signals.stop = true;
           Threads.main()->start_searching(true); // Could be sleeping
       }
       else if (token == "ponderhit")
           Search::Limits.ponder = 0; // Switch to normal search
 
+      // A scout has its own 'stop', so that it is not interrupted when a GUI
+      // stops the engine search running at the same time, or vice versa.
+      else if (token == "stop-scout")
+          Scouts.stop = true;
+
       else if (token == "uci")
           sync_cout << "id name " << engine_info(true)
                     << "\n"       << Options
@@ -232,13 +269,20 @@ void UCI::loop(int argc, char* argv[]) {
       {
           // This is NOT UCI compliant but is needed to sync with the UI
           Threads.main()->wait_for_search_finished();
+          Scouts.main()->wait_for_search_finished();
           sync_cout << "readyok" << sync_endl;
       }
       else if (token == "go")         go(pos, is);
       else if (token == "position")   position(pos, is);
       else if (token == "setoption")  setoption(is);
       else if (token == "make")       Parser::make_db(is);
+      else if (token == "make-opening") Parser::make_opening(is);
+      else if (token == "optimize")   Parser::optimize_db(is);
       else if (token == "scout")      scout(pos, is);
+      else if (token == "scout-batch") scout(pos, is, true);
+      else if (token == "explain")    scout(pos, is, false, true);
+      else if (token == "open")       open_db(is);
+      else if (token == "close")      open_db(is, true);
 
       // Additional custom non-UCI commands, useful for debugging
       else if (token == "flip")       pos.flip();